@@ -0,0 +1,207 @@
+#ifndef autotune_h
+#define autotune_h
+#include <cfloat>
+#include <omp.h>
+#include "build_tree.h"
+#include "kernel.h"
+#include "traversal.h"
+
+namespace exafmm {
+  //! Parameters, phase timings, and accuracy of one FMM run
+  struct Config {
+    int P;                                                      //!< Order of expansions
+    int ncrit;                                                  //!< Number of bodies per leaf cell
+    real_t theta;                                               //!< Multipole acceptance criterion
+    double tree;                                                //!< Build tree time [s]
+    double lists;                                               //!< Build M2L, P2P lists time [s]
+    double upward;                                              //!< P2M, M2M time [s]
+    double m2l;                                                 //!< M2L time [s]
+    double downward;                                            //!< L2L, L2P time [s]
+    double far;                                                 //!< P2M, M2M, M2L, L2L, L2P time [s]
+    double near;                                                //!< P2P time [s]
+    double total;                                               //!< Tree, lists, and evaluation time [s]
+    uint64_t numM2L;                                            //!< Number of M2L cell pairs
+    uint64_t numP2P;                                            //!< Number of P2P body pairs
+    real_t error;                                               //!< Max of rel. L2 error in p and F
+  };
+
+  /**
+   * @brief Run the free space FMM once with the P, ncrit, theta of the context
+   *
+   * @details The bodies are copied, so the caller's ordering is kept. The
+   * tree and lists are built and timed once. The lists are evaluated once to
+   * fill the translation caches, then timed on a second pass, with far and
+   * near field timed separately by evaluating the M2L and P2P lists one after
+   * the other. The total covers the tree, the lists, and the timed pass; only
+   * the warm-up evaluation is left out. The error is the larger of the
+   * relative L2 errors of p and F over numTargets bodies, measured against
+   * direct().
+   *
+   * @param ctx Context with P, ncrit, theta
+   * @param bodies Bodies to evaluate
+   * @param numTargets Number of targets for checking the error
+   * @return Timings and error of the run
+   */
+  Config measure(Context & ctx, const Bodies & bodies, int numTargets) {
+    Config config;                                              // Measured configuration
+    config.P = ctx.P;                                           // Order of expansions
+    config.ncrit = ctx.ncrit;                                   // Number of bodies per leaf cell
+    config.theta = ctx.theta;                                   // Multipole acceptance criterion
+    initKernel(ctx);                                            // Initialize kernel for P
+    Bodies ibodies = bodies;                                    // Work copy of bodies
+    for (size_t b=0; b<ibodies.size(); b++) {                   // Loop over bodies
+      ibodies[b].p = 0;                                         //  Clear potential
+      for (int d=0; d<3; d++) ibodies[b].F[d] = 0;              //  Clear force
+    }                                                           // End loop over bodies
+    double t0 = omp_get_wtime();                                // Start build tree
+    Tree tree;                                                  // Flat tree
+    buildTree(ctx, ibodies, tree);                              // Build tree
+    Cells & cells = tree.cells;                                 // Cells of tree
+    double t1 = omp_get_wtime();                                // End of build tree
+    buildLists(ctx, cells, cells);                              // Traversal recording M2L, P2P lists
+    double t2 = omp_get_wtime();                                // End of build lists
+    std::vector<Cell *> targets;                                // Cells with interaction lists
+    getTargets(cells, targets);                                 // Collect cells with interaction lists
+    config.numM2L = config.numP2P = 0;                          // Initialize interaction counts
+    for (size_t i=0; i<targets.size(); i++) {                   // Loop over target cells
+      config.numM2L += targets[i]->listM2L.size();              //  Count M2L pairs
+      for (size_t j=0; j<targets[i]->listP2P.size(); j++) {     //  Loop over P2P list
+        config.numP2P += uint64_t(targets[i]->NBODY) * targets[i]->listP2P[j]->NBODY;// Count body pairs
+      }                                                         //  End loop over P2P list
+    }                                                           // End loop over target cells
+    upwardPass(ctx, tree);                                      // Warm up M2M, M2L, L2L caches
+    evaluateLists(ctx, cells);                                  // M2L, P2P from lists
+    downwardPass(ctx, tree);                                    // Downward pass for L2L, L2P
+    for (size_t b=0; b<ibodies.size(); b++) {                   // Loop over bodies
+      ibodies[b].p = 0;                                         //  Clear potential
+      for (int d=0; d<3; d++) ibodies[b].F[d] = 0;              //  Clear force
+    }                                                           // End loop over bodies
+    double t3 = omp_get_wtime();                                // Start upward pass
+    upwardPass(ctx, tree);                                      // Upward pass for P2M, M2M
+    double t4 = omp_get_wtime();                                // Start M2L
+    evaluateM2L(ctx, targets);                                  // M2L kernels
+    double t5 = omp_get_wtime();                                // Start near field
+    evaluateP2P(ctx, targets);                                  // P2P kernels
+    double t6 = omp_get_wtime();                                // Start downward pass
+    downwardPass(ctx, tree);                                    // Downward pass for L2L, L2P
+    double t7 = omp_get_wtime();                                // End of FMM
+    config.tree = t1 - t0;                                      // Build tree time
+    config.lists = t2 - t1;                                     // Build lists time
+    config.upward = t4 - t3;                                    // Upward pass time
+    config.m2l = t5 - t4;                                       // M2L time
+    config.downward = t7 - t6;                                  // Downward pass time
+    config.far = t5 - t3 + t7 - t6;                             // Far field time
+    config.near = t6 - t5;                                      // Near field time
+    config.total = t2 - t0 + t7 - t3;                           // Total time without the warm-up
+
+    numTargets = std::min(numTargets, int(ibodies.size()));     // Cap number of targets
+    int stride = ibodies.size() / numTargets;                   // Stride of sampling
+    Bodies fmm(numTargets), exact(numTargets);                  // FMM and direct results for targets
+    for (int b=0; b<numTargets; b++) {                          // Loop over target samples
+      fmm[b] = exact[b] = ibodies[b*stride];                    //  Sample targets
+      exact[b].p = 0;                                           //  Clear potential
+      for (int d=0; d<3; d++) exact[b].F[d] = 0;                //  Clear force
+    }                                                           // End loop over target samples
+    direct(ctx, exact, ibodies);                                // Direct N-Body
+    real_t pDif = 0, pNrm = 0, FDif = 0, FNrm = 0;              // Differences and norms
+    for (int b=0; b<numTargets; b++) {                          // Loop over targets
+      pDif += (fmm[b].p - exact[b].p) * (fmm[b].p - exact[b].p);//  Difference of potential
+      pNrm += exact[b].p * exact[b].p;                          //  Value of potential
+      for (int d=0; d<3; d++) {                                 //  Loop over dimensions
+        FDif += (fmm[b].F[d] - exact[b].F[d]) * (fmm[b].F[d] - exact[b].F[d]);// Difference of force
+        FNrm += exact[b].F[d] * exact[b].F[d];                  //   Value of force
+      }                                                         //  End loop over dimensions
+    }                                                           // End loop over targets
+    config.error = std::max(std::sqrt(pDif/pNrm), std::sqrt(FDif/FNrm));// Larger of the two errors
+    return config;
+  }
+
+  //! Print one row of the autotuning table
+  void printConfig(const Config & config) {
+    printf("%-3d %-6d %-6.2f %-10.4e %-10.4e %-10.4e %-10.4e\n",
+           config.P, config.ncrit, config.theta,
+           config.far, config.near, config.total, config.error);
+  }
+
+  /**
+   * @brief Choose the fastest P, ncrit, theta that meet an error tolerance
+   *
+   * @details The search runs on every (numBodies/nsample)-th body, so the
+   * sample keeps the distribution of the full set. The error depends mostly
+   * on P and theta, so for each theta the lowest order that meets the
+   * tolerance is found first at the current ncrit. Then ncrit is swept at
+   * that order, which only trades P2P against M2L work. Raising the order
+   * stops early once a run takes twice as long as the best so far. Only
+   * orders with specialized kernels are tried. The tolerance is met on the
+   * sample, and the error of the full set can be somewhat larger. The winner
+   * is left in the P, ncrit, theta of the context with the kernel initialized
+   * for it. Periodic images are not tuned for.
+   *
+   * @param ctx Context to tune, with ncrit as the leaf size of the order search
+   * @param bodies Bodies whose distribution is tuned for
+   * @param tolerance Bound on the relative L2 error of p and F
+   * @param nsample Maximum number of bodies in the sample
+   * @param verbose Print every measured configuration
+   * @return Fastest configuration that met the tolerance, or the most
+   * accurate one if none did
+   */
+  Config autotune(Context & ctx, const Bodies & bodies, real_t tolerance, int nsample=20000, bool verbose=true) {
+    const int orders[] = {4, 6, 8, 10, 12, 16, 20};             // Orders with specialized kernels
+    const int ncrits[] = {16, 32, 64, 128, 256};                // Candidate leaf sizes
+    const real_t thetas[] = {0.3, 0.4, 0.5, 0.6};               // Candidate acceptance criteria
+    const int numTargets = 100;                                 // Number of targets for checking error
+    const int ncrit0 = ctx.ncrit;                               // Leaf size for the order search
+    int stride = std::max(int(bodies.size()) / nsample, 1);     // Stride of sampling
+    Bodies sample;                                              // Sampled bodies
+    for (size_t b=0; b<bodies.size(); b+=stride) {              // Loop over sampled bodies
+      sample.push_back(bodies[b]);                              //  Add body to sample
+    }                                                           // End loop over sampled bodies
+    if (verbose) {                                              // If verbose
+      printf("--- %-16s ------------\n", "Autotune");           //  Print message
+      printf("%-20s : %d of %d\n", "Sampled bodies", int(sample.size()), int(bodies.size()));// Sample size
+      printf("%-20s : %8.5e\n", "Tolerance", tolerance);        //  Print error bound
+      printf("%-3s %-6s %-6s %-10s %-10s %-10s %-10s\n",        //  Print table header
+             "P", "ncrit", "theta", "far [s]", "near [s]", "total [s]", "error");
+    }                                                           // End if for verbose
+    Config best;                                                // Fastest configuration meeting tolerance
+    best.total = DBL_MAX;                                       // No configuration yet
+    best.error = DBL_MAX;                                       // No configuration yet
+    Config closest = best;                                      // Most accurate configuration
+    for (real_t th : thetas) {                                  // Loop over acceptance criteria
+      ctx.theta = th;                                           //  Set acceptance criterion
+      ctx.ncrit = ncrit0;                                       //  Leaf size for the order search
+      Config config;                                            //  Lowest order meeting tolerance
+      bool found = false;                                       //  Flag for meeting tolerance
+      for (int p : orders) {                                    //  Loop over orders
+        ctx.P = p;                                              //   Set order of expansions
+        config = measure(ctx, sample, numTargets);              //   Run FMM on sample
+        if (verbose) printConfig(config);                       //   Print configuration
+        if (config.error < closest.error) closest = config;     //   Keep most accurate
+        if (config.total > 2 * best.total) break;               //   Too slow to win by tuning ncrit
+        if (config.error < tolerance) {                         //   If tolerance is met
+          found = true;                                         //    Lowest order found
+          break;                                                //    Stop raising order
+        }                                                       //   End if for tolerance
+      }                                                         //  End loop over orders
+      if (!found) continue;                                     //  Tolerance is not reachable for theta
+      if (config.total < best.total) best = config;             //  Keep fastest
+      for (int nc : ncrits) {                                   //  Loop over leaf sizes
+        if (nc == ncrit0) continue;                             //   Already measured
+        ctx.ncrit = nc;                                         //   Set leaf size
+        config = measure(ctx, sample, numTargets);              //   Run FMM on sample
+        if (verbose) printConfig(config);                       //   Print configuration
+        if (config.error < tolerance && config.total < best.total) best = config;// Keep fastest
+      }                                                         //  End loop over leaf sizes
+    }                                                           // End loop over acceptance criteria
+    if (best.total == DBL_MAX) best = closest;                  // Fall back to most accurate
+    ctx.P = best.P;                                             // Order of expansions
+    ctx.ncrit = best.ncrit;                                     // Number of bodies per leaf cell
+    ctx.theta = best.theta;                                     // Multipole acceptance criterion
+    initKernel(ctx);                                            // Initialize kernel for P
+    if (verbose) {                                              // If verbose
+      printf("%-20s : P %d, ncrit %d, theta %.2f\n", "Selected", ctx.P, ctx.ncrit, ctx.theta);// Print selection
+    }                                                           // End if for verbose
+    return best;
+  }
+}
+#endif
@@ -0,0 +1,68 @@
+#include "autotune.h"
+using namespace exafmm;
+
+//! Uniform cube [-pi, pi]^3, sphere surface of radius pi, or Plummer of scale 0.1, with zero net charge
+void initBodies(Bodies & bodies, const std::string & distribution) {
+  srand48(0);
+  real_t average = 0;
+  for (size_t b=0; b<bodies.size(); b++) {
+    if (distribution == "cube") {
+      for (int d=0; d<3; d++) bodies[b].X[d] = drand48() * 2 * M_PI - M_PI;
+    } else {
+      real_t r = M_PI;
+      if (distribution == "plummer") r = 0.1 / std::sqrt(std::pow(drand48() * 0.999, -2.0 / 3) - 1);
+      real_t z = drand48() * 2 - 1;
+      real_t phi = drand48() * 2 * M_PI;
+      bodies[b].X[0] = r * std::sqrt(1 - z * z) * std::cos(phi);
+      bodies[b].X[1] = r * std::sqrt(1 - z * z) * std::sin(phi);
+      bodies[b].X[2] = r * z;
+    }
+    bodies[b].q = drand48() - .5;
+    average += bodies[b].q;
+  }
+  average /= bodies.size();
+  for (size_t b=0; b<bodies.size(); b++) bodies[b].q -= average;
+}
+
+/**
+ * Usage: benchmark [maxN] [P] [ncrit]
+ *
+ * Sweeps N = 1e3, 1e4, ... up to maxN over the three distributions and, unless
+ * given, over P and ncrit. One CSV row per run, with times in seconds,
+ * throughput in interactions per second, and the error against direct
+ * summation on 100 sampled targets.
+ */
+int main(int argc, char ** argv) {
+  const int maxN = argc > 1 ? atoi(argv[1]) : 100000;
+  std::vector<int> orders = {4, 8, 12};
+  std::vector<int> ncrits = {32, 64, 128};
+  if (argc > 2) orders.assign(1, atoi(argv[2]));
+  if (argc > 3) ncrits.assign(1, atoi(argv[3]));
+  const char * distributions[] = {"cube", "sphere", "plummer"};
+  Context ctx;
+  ctx.images = 0;
+  ctx.cycle = 0;
+  ctx.theta = 0.4;
+  ctx.nspawn = 1000;
+
+  printf("dist,N,P,ncrit,theta,threads,tree,lists,upward,m2l,p2p,downward,total,m2l_per_s,p2p_per_s,error\n");
+  for (int N=1000; N<=maxN; N*=10) {
+    for (const char * distribution : distributions) {
+      Bodies bodies(N);
+      initBodies(bodies, distribution);
+      for (int p : orders) {
+        for (int nc : ncrits) {
+          ctx.P = p;
+          ctx.ncrit = nc;
+          Config c = measure(ctx, bodies, 100);
+          printf("%s,%d,%d,%d,%.2f,%d,%.3e,%.3e,%.3e,%.3e,%.3e,%.3e,%.3e,%.3e,%.3e,%.3e\n",
+                 distribution, N, ctx.P, ctx.ncrit, ctx.theta, omp_get_max_threads(),
+                 c.tree, c.lists, c.upward, c.m2l, c.near, c.downward, c.total,
+                 c.m2l > 0 ? c.numM2L / c.m2l : 0, c.near > 0 ? c.numP2P / c.near : 0, c.error);
+          fflush(stdout);
+        }
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,68 @@
+#include "build_tree.h"
+using namespace exafmm;
+
+int main(int argc, char ** argv) {
+  const int numBodies = argc > 1 ? atoi(argv[1]) : 1000000;
+  Context ctx;
+  ctx.P = 10;
+  ctx.ncrit = 64;
+  initKernel(ctx);
+
+  // Uniform and clustered (Plummer) distributions
+  Bodies uniform(numBodies), plummer(numBodies);
+  srand48(0);
+  for (int b=0; b<numBodies; b++) {
+    for (int d=0; d<3; d++) uniform[b].X[d] = drand48() * 2 * M_PI - M_PI;
+    real_t r = 1 / std::sqrt(std::pow(drand48() * 0.999, -2.0 / 3) - 1);
+    real_t z = drand48() * 2 - 1;
+    real_t phi = drand48() * 2 * M_PI;
+    plummer[b].X[0] = r * std::sqrt(1 - z * z) * std::cos(phi);
+    plummer[b].X[1] = r * std::sqrt(1 - z * z) * std::sin(phi);
+    plummer[b].X[2] = r * z;
+    uniform[b].q = plummer[b].q = 1.0 / numBodies;
+  }
+
+  // Strong scaling of buildTree
+  printf("--- %-16s ------------\n", "Build tree");
+  printf("%-8s %12s %12s %8s %8s\n", "Threads", "Uniform", "Plummer", "Speedup", "Speedup");
+  const int maxThreads = omp_get_max_threads();
+  double base[2] = {0, 0};
+  for (int threads=1; threads<=maxThreads; threads*=2) {
+    omp_set_num_threads(threads);
+    double time[2];
+    for (int i=0; i<2; i++) {
+      time[i] = 1e30;
+      for (int it=0; it<3; it++) {
+        Bodies bodies = i == 0 ? uniform : plummer;
+        Tree tree;
+        double t0 = omp_get_wtime();
+        buildTree(ctx, bodies, tree);
+        time[i] = std::min(time[i], omp_get_wtime() - t0);
+      }
+      if (threads == 1) base[i] = time[i];
+    }
+    printf("%-8d %10.6f s %10.6f s %8.2f %8.2f\n", threads, time[0], time[1],
+           base[0] / time[0], base[1] / time[1]);
+  }
+
+  // Tree update after a small time step, against a rebuild
+  printf("--- %-16s ------------\n", "Update tree");
+  printf("%-8s %10s %12s %12s\n", "Step", "Moved", "Update", "Rebuild");
+  omp_set_num_threads(maxThreads);
+  for (real_t dx=1e-4; dx<2e-2; dx*=10) {
+    Bodies bodies = uniform;
+    Tree tree;
+    buildTree(ctx, bodies, tree);
+    for (int b=0; b<numBodies; b++) {
+      for (int d=0; d<3; d++) bodies[b].X[d] = bodies[b].X[d] * (1 - dx) + (drand48() - .5) * dx;
+    }
+    Bodies bodies2 = bodies;
+    double t0 = omp_get_wtime();
+    int moved = updateTree(ctx, bodies, tree);
+    double t1 = omp_get_wtime();
+    buildTree(ctx, bodies2, tree);
+    double t2 = omp_get_wtime();
+    printf("%-8.0e %10d %10.6f s %10.6f s\n", dx, moved, t1 - t0, t2 - t1);
+  }
+  return 0;
+}
@@ -1,9 +1,13 @@
 #ifndef buildtree_h
 #define buildtree_h
+#include <algorithm>
+#include <omp.h>
+#include <stdint.h>
+#include "kernel.h"
 #include "types.h"
 
 namespace exafmm {
-  int ncrit;                                                    //!< Number of bodies per leaf cell
+  const int maxLevel = 21;                                      //!< Maximum depth of tree, 3 * 21 bits of a Morton key
 
   /**
    * @brief Get bounding box of bodies
@@ -15,6 +19,7 @@ namespace exafmm {
   void getBounds(Bodies & bodies, real_t & R0, real_t * X0) {
     real_t Xmin[3], Xmax[3];                                    // Min, max of domain
     for (int d=0; d<3; d++) Xmin[d] = Xmax[d] = bodies[0].X[d]; // Initialize Xmin, Xmax
+#pragma omp parallel for reduction(min:Xmin[:3]) reduction(max:Xmax[:3])
     for (int b=0; b<int(bodies.size()); b++) {                  // Loop over range of bodies
       for (int d=0; d<3; d++) Xmin[d] = fmin(bodies[b].X[d], Xmin[d]);//  Update Xmin
       for (int d=0; d<3; d++) Xmax[d] = fmax(bodies[b].X[d], Xmax[d]);//  Update Xmax
@@ -29,87 +34,409 @@ namespace exafmm {
   }
 
   /**
-   * @brief Build cells of tree adaptively using a top-down approach based on recursion
+   * @brief Morton key of a position at maxLevel
    *
-   * @param bodies Vector of bodies
-   * @param buffer A copy of bodies, used as buffer
-   * @param begin Index of the first body
-   * @param end Index of the last body
-   * @param X Center position of cell
-   * @param R Radius of cell
-   * @param level Level of cell in tree
-   * @param direction Direction
+   * @details Bits are interleaved as x, y, z from the least significant end of
+   * each triplet, so the three bits of a level give the octant numbering of
+   * (x >= Xc) + ((y >= Yc) << 1) + ((z >= Zc) << 2).
+   *
+   * @param X Position
+   * @param X0 Center of the root cell
+   * @param R0 Radius of the root cell
+   */
+  uint64_t mortonKey(const real_t * X, const real_t * X0, real_t R0) {
+    const int nx = 1 << maxLevel;                               // Number of grid points per dimension
+    uint64_t key = 0;                                           // Initialize key
+    for (int d=0; d<3; d++) {                                   // Loop over dimensions
+      int ix = int((X[d] - X0[d] + R0) / (2 * R0) * nx);        //  Grid index
+      ix = ix < 0 ? 0 : (ix >= nx ? nx - 1 : ix);               //  Clamp to grid
+      for (int l=0; l<maxLevel; l++) {                          //  Loop over bits
+        key |= uint64_t((ix >> l) & 1) << (3 * l + d);          //   Interleave bit
+      }                                                         //  End loop over bits
+    }                                                           // End loop over dimensions
+    return key;                                                 // Return key
+  }
+
+  /**
+   * @brief Sort bodies by Morton key with a parallel least significant digit radix sort
+   *
+   * @details Each thread histograms a contiguous block of keys, the histograms
+   * are scanned in bucket-major, thread-minor order, and each thread scatters its
+   * block to the resulting offsets, which keeps every pass stable.
+   *
+   * @param bodies Vector of bodies, permuted in place
+   * @param keys Morton keys of bodies, sorted on return
+   */
+  void sortBodies(Bodies & bodies, std::vector<uint64_t> & keys) {
+    const int bits = 8;                                         // Bits per radix digit
+    const int nbucket = 1 << bits;                              // Number of buckets
+    int n = bodies.size();                                      // Number of bodies
+    std::vector<int> index(n), index2(n);                       // Permutation and buffer
+    std::vector<uint64_t> keys2(n);                             // Buffer for keys
+    std::vector<int> offset(omp_get_max_threads()*nbucket);     // Histogram of each thread, then offsets
+#pragma omp parallel for
+    for (int i=0; i<n; i++) index[i] = i;                       // Identity permutation
+    for (int shift=0; shift<3*maxLevel; shift+=bits) {          // Loop over digits
+#pragma omp parallel
+      {
+        int nthreads = omp_get_num_threads();                   //   Number of threads
+        int t = omp_get_thread_num();                           //   Thread index
+        int begin = int(int64_t(n) * t / nthreads);             //   First key of this thread
+        int end = int(int64_t(n) * (t + 1) / nthreads);         //   End of keys of this thread
+        int * count = &offset[t*nbucket];                       //   Histogram of this thread
+        for (int b=0; b<nbucket; b++) count[b] = 0;             //   Clear histogram
+        for (int i=begin; i<end; i++) count[(keys[i] >> shift) & (nbucket - 1)]++;// Histogram
+#pragma omp barrier
+#pragma omp single
+        for (int b=0, sum=0; b<nbucket; b++) {                  //   Loop over buckets
+          for (int i=0; i<nthreads; i++) {                      //    Loop over threads
+            int c = offset[i*nbucket+b];                        //     Count of bucket in thread
+            offset[i*nbucket+b] = sum;                          //     Exclusive scan
+            sum += c;                                           //     Running sum
+          }                                                     //    End loop over threads
+        }                                                       //   End loop over buckets
+        for (int i=begin; i<end; i++) {                         //   Loop over keys of this thread
+          int j = count[(keys[i] >> shift) & (nbucket - 1)]++;  //    Destination
+          keys2[j] = keys[i];                                   //    Scatter key
+          index2[j] = index[i];                                 //    Scatter permutation
+        }                                                       //   End loop over keys
+      }                                                         //  End parallel region
+      keys.swap(keys2);                                         //  Sorted keys for next digit
+      index.swap(index2);                                       //  Permutation for next digit
+    }                                                           // End loop over digits
+    Bodies buffer(n);                                           // Buffer for permuted bodies
+#pragma omp parallel for
+    for (int i=0; i<n; i++) buffer[i] = bodies[index[i]];       // Permute bodies
+    bodies.swap(buffer);                                        // Sorted bodies
+  }
+
+  /**
+   * @brief Build cells of tree adaptively, level by level, from Morton sorted keys
+   *
+   * @details A cell with more than ncrit bodies is split into its nonempty
+   * octants, whose key ranges are found by binary search. Each level is
+   * processed in parallel: count children, scan, then create them, so the cells
+   * come out in level order with the children of a cell contiguous.
+   *
+   * @param ctx Context with ncrit
+   * @param keys Sorted Morton keys of bodies
+   * @param X0 Center of the root cell
+   * @param R0 Radius of the root cell
+   * @param cells Cells in level order
+   * @param levels Index of the first cell of each level, and the number of cells
+   * @param ibody Index of the first body of each cell
+   * @param ichild Index of the first child of each cell
+   */
+  void buildCells(Context & ctx, std::vector<uint64_t> & keys, real_t * X0, real_t R0, Cells & cells,
+                  std::vector<int> & levels, std::vector<int> & ibody, std::vector<int> & ichild) {
+    cells.resize(1);                                            // Root cell
+    ibody.assign(1, 0);                                         // Root starts at first body
+    ichild.assign(1, 0);                                        // Root has no children yet
+    cells[0].NBODY = keys.size();                               // Root holds all bodies
+    cells[0].NCHILD = 0;                                        // Initialize counter for child cells
+    for (int d=0; d<3; d++) cells[0].X[d] = X0[d];              // Center position of root
+    cells[0].R = R0;                                            // Radius of root
+    cells[0].LEVEL = 0;                                         // Level of root
+    levels.assign(1, 0);                                        // Root level starts at 0
+    for (int level=0; level<maxLevel; level++) {                // Loop over levels
+      int begin = levels[level], end = cells.size();            //  Range of cells at this level
+      levels.push_back(end);                                    //  Next level starts at end
+      int shift = 3 * (maxLevel - 1 - level);                   //  Shift of child octant bits
+      std::vector<int> bounds(9*(end-begin));                   //  Body offsets of octants
+      std::vector<int> offsets(end-begin+1, 0);                 //  Offsets of first child
+#pragma omp parallel for
+      for (int c=begin; c<end; c++) {                           //  Loop over cells at this level
+        int * bound = &bounds[9*(c-begin)];                     //   Octant offsets of this cell
+        int b0 = ibody[c], b1 = ibody[c] + cells[c].NBODY;      //   Range of bodies
+        cells[c].NCHILD = 0;                                    //   Initialize counter for child cells
+        if (cells[c].NBODY <= ctx.ncrit) continue;              //   Leaf cell
+        uint64_t prefix = keys[b0] >> (shift + 3) << (shift + 3);//  Key bits of this cell
+        for (int i=0; i<8; i++) {                               //   Loop over octants
+          bound[i] = std::lower_bound(keys.begin()+b0, keys.begin()+b1,// First body in octant
+                                      prefix | (uint64_t(i) << shift)) - keys.begin();
+          if (i > 0 && bound[i] > bound[i-1]) cells[c].NCHILD++;//    Count nonempty octant
+        }                                                       //   End loop over octants
+        bound[8] = b1;                                          //   End of last octant
+        if (bound[8] > bound[7]) cells[c].NCHILD++;             //   Count last octant
+        offsets[c-begin+1] = cells[c].NCHILD;                   //   Number of children
+      }                                                         //  End loop over cells at this level
+      for (int c=0; c<end-begin; c++) offsets[c+1] += offsets[c];// Inclusive scan
+      if (offsets[end-begin] == 0) break;                       //  No more children
+      cells.resize(end + offsets[end-begin]);                   //  Allocate next level
+      ibody.resize(cells.size());                               //  Allocate body offsets
+      ichild.resize(cells.size());                              //  Allocate child offsets
+#pragma omp parallel for
+      for (int c=begin; c<end; c++) {                           //  Loop over cells at this level
+        int * bound = &bounds[9*(c-begin)];                     //   Octant offsets of this cell
+        int child = end + offsets[c-begin];                     //   Index of first child
+        ichild[c] = child;                                      //   Store index of first child
+        real_t r = cells[c].R / 2;                              //   Radius of child
+        for (int i=0; i<8 && cells[c].NCHILD; i++) {            //   Loop over octants
+          if (bound[i+1] == bound[i]) continue;                 //    Skip empty octant
+          Cell & C = cells[child];                              //    Child cell
+          ibody[child] = bound[i];                              //    Index of first body
+          C.NBODY = bound[i+1] - bound[i];                      //    Number of bodies
+          C.NCHILD = 0;                                         //    Initialize counter for child cells
+          for (int d=0; d<3; d++) {                             //    Loop over dimensions
+            C.X[d] = cells[c].X[d] + r * (((i >> d) & 1) * 2 - 1);//   Center of child
+          }                                                     //    End loop over dimensions
+          C.R = r;                                              //    Radius of child
+          C.LEVEL = level + 1;                                  //    Level of child
+          child++;                                              //    Increment child index
+        }                                                       //   End loop over octants
+      }                                                         //  End loop over cells at this level
+    }                                                           // End loop over levels
+    if (levels.back() != int(cells.size())) levels.push_back(cells.size());// End of last level
+  }
+
+  /**
+   * @brief Build a Morton ordered tree in a flat cell array with a given root box
+   *
+   * @details Bodies are sorted in place by Morton key, cells are stored in level
+   * order, and the M and L coefs of all cells live in one arena of the tree.
+   * initKernel() must be called first so that NTERM and NRHS are known. Bodies must lie
+   * inside the root box.
+   *
+   * @param ctx Context with ncrit, NTERM, NRHS
+   * @param bodies Vector of bodies, sorted on return
+   * @param tree Tree to build, existing storage is reused
+   * @param X0 Center of the root cell
+   * @param R0 Radius of the root cell
    */
-  void buildCells(Body * bodies, Body * buffer, int begin, int end, Cell * cell,
-                  real_t * X, real_t R, int level=0, bool direction=false) {
-    //! Create a tree cell
-    cell->BODY = bodies + begin;                                // Pointer of first body in cell
-    if(direction) cell->BODY = buffer + begin;                  // Pointer of first body in cell
-    cell->NBODY = end - begin;                                  // Number of bodies in cell
-    cell->NCHILD = 0;                                           // Initialize counter for child cells
-    for (int d=0; d<3; d++) cell->X[d] = X[d];                  // Center position of cell
-    cell->R = R / (1 << level);                                 // Cell radius
-    //! If cell is a leaf
-    if (end - begin <= ncrit) {                                 // If number of bodies is less than threshold
-      if (direction) {                                          //  If direction of data is from bodies to buffer
-        for (int i=begin; i<end; i++) {                         //   Loop over bodies in cell
-          for (int d=0; d<3; d++) buffer[i].X[d] = bodies[i].X[d];//  Copy bodies coordinates to buffer
-          buffer[i].q = bodies[i].q;                            //    Copy bodies source to buffer
-        }                                                       //   End loop over bodies in cell
-      }                                                         //  End if for direction of data
-      return;                                                   //  Return without recursion
-    }                                                           // End if for number of bodies
-    //! Count number of bodies in each octant
-    int size[8] = {0,0,0,0,0,0,0,0};
-    real_t x[3];                                                // Coordinates of bodies
-    for (int i=begin; i<end; i++) {                             // Loop over bodies in cell
-      for (int d=0; d<3; d++) x[d] = bodies[i].X[d];            //  Position of body
-      int octant = (x[0] > X[0]) + ((x[1] > X[1]) << 1) + ((x[2] > X[2]) << 2);// Which octant body belongs to
-      size[octant]++;                                           //  Increment body count in octant
-    }                                                           // End loop over bodies in cell
-    //! Exclusive scan to get offsets
-    int offset = begin;                                         // Offset of first octant
-    int offsets[8], counter[8];                                 // Offsets and counter for each octant
-    for (int i=0; i<8; i++) {                                   // Loop over elements
-      offsets[i] = offset;                                      //  Set value
-      offset += size[i];                                        //  Increment offset
-      if (size[i]) cell->NCHILD++;                              //  Increment child cell counter
-    }                                                           // End loop over elements
-    //! Sort bodies by octant
-    for (int i=0; i<8; i++) counter[i] = offsets[i];            // Copy offsets to counter
-    for (int i=begin; i<end; i++) {                             // Loop over bodies
-      for (int d=0; d<3; d++) x[d] = bodies[i].X[d];            //  Position of body
-      int octant = (x[0] > X[0]) + ((x[1] > X[1]) << 1) + ((x[2] > X[2]) << 2);// Which octant body belongs to
-      for (int d=0; d<3; d++) buffer[counter[octant]].X[d] = bodies[i].X[d];// Permute bodies coordinates out-of-place according to octant
-      buffer[counter[octant]].q = bodies[i].q;                //  Permute bodies sources out-of-place according to octant
-      counter[octant]++;                                      //  Increment body count in octant
+  void buildTree(Context & ctx, Bodies & bodies, Tree & tree, real_t * X0, real_t R0) {
+    std::vector<uint64_t> keys(bodies.size());                  // Morton keys
+#pragma omp parallel for
+    for (int b=0; b<int(bodies.size()); b++) {                  // Loop over bodies
+      keys[b] = mortonKey(bodies[b].X, X0, R0);                 //  Morton key of body
     }                                                           // End loop over bodies
-    //! Loop over children and recurse
-    real_t Xchild[3];                                           // Coordinates of children
-    Cell * child = new Cell[cell->NCHILD];                      // Allocate memory for child cells
-    cell->CHILD = child;                                        // Pointer for first child cell
-    int c = 0;                                                  // Counter for child cells
-    for (int i=0; i<8; i++) {                                   // Loop over children
-      for (int d=0; d<3; d++) Xchild[d] = X[d];                 //  Initialize center position of child cell
-      real_t r = R / (1 << (level + 1));                        //  Radius of cells for child's level
+    sortBodies(bodies, keys);                                   // Sort bodies by key
+    std::vector<int> ibody, ichild;                             // Body and child offsets of cells
+    Cells & cells = tree.cells;                                 // Cells of tree
+    buildCells(ctx, keys, X0, R0, cells, tree.levels, ibody, ichild);// Build cells level by level
+    int ncells = cells.size();                                  // Number of cells
+    tree.leafs.clear();                                         // Clear leaf cells
+    for (int c=0; c<ncells; c++) {                              // Loop over cells
+      if (cells[c].NCHILD == 0) tree.leafs.push_back(c);        //  Collect leaf cell
+    }                                                           // End loop over cells
+    std::sort(tree.leafs.begin(), tree.leafs.end(),             // Sort leaf cells in body order
+              [&](int a, int b) { return ibody[a] < ibody[b]; });
+    tree.leafIndex.assign(ncells, -1);                          // Not a leaf by default
+    for (size_t l=0; l<tree.leafs.size(); l++) tree.leafIndex[tree.leafs[l]] = l;// Invert leafs
+    tree.coefs.assign(2*ncells*ctx.NTERM*ctx.NRHS, 0);          // Arena of M and L
+#pragma omp parallel for
+    for (int c=0; c<ncells; c++) {                              // Loop over cells
+      cells[c].BODY = &bodies[ibody[c]];                        //  Pointer of first body
+      cells[c].CHILD = cells.data() + ichild[c];                //  Pointer of first child
+      cells[c].M = &tree.coefs[c*ctx.NTERM*ctx.NRHS];           //  Multipole coefs in arena
+      cells[c].L = &tree.coefs[(ncells+c)*ctx.NTERM*ctx.NRHS];  //  Local coefs in arena
+    }                                                           // End loop over cells
+  }
+
+  /**
+   * @brief Build a Morton ordered tree around the bodies
+   *
+   * @details With cycle > 0, the root cell is the periodic box, and bodies must
+   * lie inside it. Otherwise the root is the bounding box of the bodies.
+   *
+   * @param ctx Context with cycle
+   * @param bodies Vector of bodies, sorted on return
+   * @param tree Tree to build, existing storage is reused
+   */
+  void buildTree(Context & ctx, Bodies & bodies, Tree & tree) {
+    real_t R0, X0[3];                                           // Radius and center root cell
+    if (ctx.cycle > 0) {                                        // If periodic
+      R0 = ctx.cycle / 2;                                       //  Root cell is the periodic box
+      for (int d=0; d<3; d++) X0[d] = 0;                        //  Centered at the origin
+    } else {                                                    // Else free space
+      getBounds(bodies, R0, X0);                                //  Get bounding box from bodies
+    }                                                           // End if for periodic
+    buildTree(ctx, bodies, tree, X0, R0);                       // Build tree in root box
+  }
+
+  /**
+   * @brief Build separate target and source trees in a common root box
+   *
+   * @details Cells of both trees then lie on the same lattice, so M2L between
+   * them uses the cached harmonics of integer offsets. Each tree only holds its
+   * own bodies, so the cost of traversal follows the sizes of the two sets.
+   *
+   * @param ctx Context with cycle
+   * @param ibodies Target bodies, sorted on return
+   * @param itree Target tree
+   * @param jbodies Source bodies, sorted on return
+   * @param jtree Source tree
+   */
+  void buildTrees(Context & ctx, Bodies & ibodies, Tree & itree, Bodies & jbodies, Tree & jtree) {
+    real_t R0, X0[3];                                           // Radius and center root cell
+    if (ctx.cycle > 0) {                                        // If periodic
+      R0 = ctx.cycle / 2;                                       //  Root cell is the periodic box
+      for (int d=0; d<3; d++) X0[d] = 0;                        //  Centered at the origin
+    } else {                                                    // Else free space
+      Bodies corners(2);                                        //  Bounding boxes of both sets
+      real_t Ri, Xi[3], Rj, Xj[3];                              //  Radius and center of each set
+      getBounds(ibodies, Ri, Xi);                               //  Bounding box of targets
+      getBounds(jbodies, Rj, Xj);                               //  Bounding box of sources
       for (int d=0; d<3; d++) {                                 //  Loop over dimensions
-        Xchild[d] += r * (((i & 1 << d) >> d) * 2 - 1);         //   Shift center position to that of child cell
+        corners[0].X[d] = std::min(Xi[d] - Ri, Xj[d] - Rj);     //   Lower corner
+        corners[1].X[d] = std::max(Xi[d] + Ri, Xj[d] + Rj);     //   Upper corner
       }                                                         //  End loop over dimensions
-      if (size[i]) {                                            //  If child exists
-        buildCells(buffer, bodies, offsets[i], offsets[i] + size[i],// Recursive call for each child
-                   &child[c], Xchild, R, level+1, !direction);
-        c++;                                                    //   Increment child cell counter
-      }                                                         //  End if for child
-    }                                                           // End loop over children
+      getBounds(corners, R0, X0);                               //  Box enclosing both
+    }                                                           // End if for periodic
+    buildTree(ctx, ibodies, itree, X0, R0);                     // Build target tree
+    buildTree(ctx, jbodies, jtree, X0, R0);                     // Build source tree
+  }
+
+  //! Whether a position is inside the half-open box of a cell, as binned by mortonKey()
+  inline bool inCell(const real_t * X, const Cell & C) {
+    for (int d=0; d<3; d++) {                                   // Loop over dimensions
+      if (X[d] < C.X[d] - C.R || X[d] >= C.X[d] + C.R) return false;// Outside in this dimension
+    }                                                           // End loop over dimensions
+    return true;                                                // Inside
   }
 
-  Cell * buildTree(Bodies & bodies) {
-    real_t R0, X0[3];                                             // Radius and center root cell
-    getBounds(bodies, R0, X0);                                    // Get bounding box from bodies
-    Bodies buffer = bodies;                                       // Copy bodies to buffer
-    Cell * cells = new Cell();                                    // Create root cell
-    buildCells(&bodies[0], &buffer[0], 0, bodies.size(), cells, X0, R0);// Build tree recursively
-    return cells;                                                 // Return pointer of root cell
+  /**
+   * @brief Update the tree after bodies moved, reusing its cells and coefs
+   *
+   * @details Bodies are expected in the order left by buildTree(), with new
+   * positions written in place. The bodies that left their leaf are counted per
+   * leaf, and the counts are scanned into offsets of a mover list, so the list
+   * comes out in body order without locks or sorting. Only the movers are
+   * re-binned, by descending from the root, and counted per new leaf. A leaf is
+   * affected if bodies leave or enter it, or if its range shifts because of the
+   * leafs before it. Only affected leafs are packed into the buffer of the tree
+   * and copied back, so bodies far from any mover stay where they are. If more
+   * than half of the bodies are affected, all leafs are packed and the buffer is
+   * swapped with the bodies, which copies each body once. The body ranges of all
+   * cells are then refitted bottom up. The cell boxes are the fixed octree boxes,
+   * so they need no refit. Interaction lists stay valid. The tree is rebuilt if
+   * a body leaves the root, lands in an octant with no cell, or a leaf grows
+   * beyond 2 * ncrit.
+   *
+   * @param ctx Context with ncrit
+   * @param bodies Vector of bodies in tree order, with updated positions
+   * @param tree Tree built from bodies
+   * @return Number of bodies that changed leaf, or -1 if the tree was rebuilt
+   */
+  int updateTree(Context & ctx, Bodies & bodies, Tree & tree) {
+    Cells & cells = tree.cells;                                 // Cells of tree
+    std::vector<int> & leafs = tree.leafs;                      // Leaf cells in body order
+    int nleafs = leafs.size();                                  // Number of leaf cells
+    tree.moveCounts.resize(2*(nleafs+1));                       // No allocation after first update
+    int * outOffset = &tree.moveCounts[0];                      // Movers out of each leaf, then offsets
+    int * inOffset = &tree.moveCounts[nleafs+1];                // Movers into each leaf, then offsets
+#pragma omp parallel for schedule(dynamic)
+    for (int l=0; l<nleafs; l++) {                              // Loop over leaf cells
+      Cell & C = cells[leafs[l]];                               //  Leaf cell
+      int b0 = C.BODY - &bodies[0];                             //  Index of first body
+      outOffset[l] = 0;                                         //  Initialize movers out
+      for (int b=b0; b<b0+C.NBODY; b++) {                       //  Loop over bodies in leaf
+        if (!inCell(bodies[b].X, C)) outOffset[l]++;            //   Body moved out
+      }                                                         //  End loop over bodies in leaf
+      inOffset[l] = 0;                                          //  Initialize movers in
+    }                                                           // End loop over leaf cells
+    outOffset[nleafs] = inOffset[nleafs] = 0;                   // Ends of scans
+    for (int l=0, sum=0; l<=nleafs; l++) {                      // Loop over leaf cells
+      int count = outOffset[l];                                 //  Movers out of leaf
+      outOffset[l] = sum;                                       //  Exclusive scan
+      sum += count;                                             //  Running sum
+    }                                                           // End loop over leaf cells
+    int nmovers = outOffset[nleafs];                            // Number of movers
+    if (nmovers == 0) return 0;                                 // Nothing to re-bin
+    std::vector<int> & movers = tree.movers;                    // Body index, new leaf, arrivals by leaf
+    movers.resize(3*nmovers);                                   // No allocation for fewer movers
+#pragma omp parallel for schedule(dynamic)
+    for (int l=0; l<nleafs; l++) {                              // Loop over leaf cells
+      if (outOffset[l] == outOffset[l+1]) continue;             //  No movers out of leaf
+      Cell & C = cells[leafs[l]];                               //  Leaf cell
+      int b0 = C.BODY - &bodies[0], i = outOffset[l];           //  Index of first body and of mover
+      for (int b=b0; b<b0+C.NBODY; b++) {                       //  Loop over bodies in leaf
+        if (!inCell(bodies[b].X, C)) movers[i++] = b;           //   Record mover
+      }                                                         //  End loop over bodies in leaf
+    }                                                           // End loop over leaf cells
+#pragma omp parallel for
+    for (int i=0; i<nmovers; i++) {                             // Loop over movers
+      const real_t * X = bodies[movers[i]].X;                   //  Position of mover
+      Cell * C = &cells[0];                                     //  Start from root
+      if (!inCell(X, *C)) C = NULL;                             //  Left the root
+      while (C && C->NCHILD) {                                  //  Descend to leaf
+        Cell * child = NULL;                                    //   Child containing X
+        for (Cell * c=C->CHILD; c!=C->CHILD+C->NCHILD; c++) {   //   Loop over children
+          if ((X[0] >= C->X[0]) == (c->X[0] > C->X[0]) &&       //    Same octant in x
+              (X[1] >= C->X[1]) == (c->X[1] > C->X[1]) &&       //    Same octant in y
+              (X[2] >= C->X[2]) == (c->X[2] > C->X[2])) child = c;//  Same octant in z
+        }                                                       //   End loop over children
+        C = child;                                              //   Descend, NULL if octant has no cell
+      }                                                         //  End descend to leaf
+      movers[nmovers+i] = C ? tree.leafIndex[C - &cells[0]] : -1;//  New leaf of mover
+    }                                                           // End loop over movers
+    bool rebuild = false;                                       // Whether the tree must be rebuilt
+    for (int i=0; i<nmovers && !rebuild; i++) {                 // Loop over movers
+      int l = movers[nmovers+i];                                //  New leaf
+      if (l < 0) rebuild = true;                                //  No leaf to go to
+      else inOffset[l]++;                                       //  Count arrival
+    }                                                           // End loop over movers
+    for (int l=0, sum=0; l<=nleafs && !rebuild; l++) {          // Loop over leaf cells
+      int count = inOffset[l];                                  //  Movers into leaf
+      if (l < nleafs && cells[leafs[l]].NBODY - (outOffset[l+1] - outOffset[l]) + count > 2 * ctx.ncrit)
+        rebuild = true;                                         //  Leaf overflows
+      inOffset[l] = sum;                                        //  Exclusive scan
+      sum += count;                                             //  Running sum
+    }                                                           // End loop over leaf cells
+    if (rebuild) {                                              // If tree cannot be updated
+      buildTree(ctx, bodies, tree);                             //  Rebuild from scratch
+      return -1;                                                //  Signal rebuild
+    }                                                           // End if for rebuild
+    int * arrivals = &movers[2*nmovers];                        // Movers grouped by new leaf
+    for (int i=0; i<nmovers; i++) {                             // Loop over movers in body order
+      arrivals[inOffset[movers[nmovers+i]]++] = movers[i];      //  Counting sort by new leaf
+    }                                                           // End loop over movers
+    for (int l=nleafs; l>0; l--) inOffset[l] = inOffset[l-1];   // Shift ends back to starts
+    inOffset[0] = 0;                                            // Start of first leaf
+    int naffected = 0;                                          // Bodies in affected leafs
+#pragma omp parallel for reduction(+:naffected)
+    for (int l=0; l<nleafs; l++) {                              // Loop over leaf cells
+      if (inOffset[l] != outOffset[l] || outOffset[l] != outOffset[l+1] || inOffset[l] != inOffset[l+1])
+        naffected += cells[leafs[l]].NBODY;                     //  Count bodies of affected leaf
+    }                                                           // End loop over leaf cells
+    bool all = naffected > int(bodies.size()) / 2;              // Cheaper to pack all leafs and swap
+    Bodies & buffer = tree.buffer;                              // Buffer for packed leafs
+    buffer.resize(bodies.size());                               // No allocation after first update
+#pragma omp parallel for schedule(dynamic)
+    for (int l=0; l<nleafs; l++) {                              // Loop over leaf cells
+      int shift = inOffset[l] - outOffset[l];                   //  Shift of range by leafs before
+      bool affected = shift || outOffset[l] != outOffset[l+1] || inOffset[l] != inOffset[l+1];// Leaf changes
+      if (!all && !affected) continue;                          //  Leaf stays in place
+      Cell & C = cells[leafs[l]];                               //  Leaf cell
+      int b0 = C.BODY - &bodies[0], i = b0 + shift;             //  Old and new index of first body
+      for (int b=b0; b<b0+C.NBODY; b++) {                       //  Loop over bodies in leaf
+        if (inCell(bodies[b].X, C)) buffer[i++] = bodies[b];    //   Pack stayer
+      }                                                         //  End loop over bodies in leaf
+      for (int a=inOffset[l]; a<inOffset[l+1]; a++) {           //  Loop over arrivals
+        buffer[i++] = bodies[arrivals[a]];                      //   Append after stayers
+      }                                                         //  End loop over arrivals
+    }                                                           // End loop over leaf cells
+    if (all) bodies.swap(buffer);                               // Packed bodies
+#pragma omp parallel for schedule(dynamic)
+    for (int l=0; l<nleafs; l++) {                              // Loop over leaf cells
+      int shift = inOffset[l] - outOffset[l];                   //  Shift of range by leafs before
+      bool affected = shift || outOffset[l] != outOffset[l+1] || inOffset[l] != inOffset[l+1];// Leaf changes
+      Cell & C = cells[leafs[l]];                               //  Leaf cell
+      int b0 = C.BODY - (all ? &buffer[0] : &bodies[0]) + shift;//  New index of first body
+      C.NBODY += inOffset[l+1] - inOffset[l] - (outOffset[l+1] - outOffset[l]);// New number of bodies
+      C.BODY = bodies.data() + b0;                              //  New first body
+      if (!all && affected) std::copy(buffer.data() + b0, buffer.data() + b0 + C.NBODY, C.BODY);// Copy back
+    }                                                           // End loop over leaf cells
+    for (int level=tree.levels.size()-2; level>=0; level--) {   // Loop over levels bottom up
+#pragma omp parallel for
+      for (int c=tree.levels[level]; c<tree.levels[level+1]; c++) {// Loop over cells at this level
+        Cell & C = cells[c];                                    //   Cell
+        if (C.NCHILD == 0) continue;                            //   Leaf is already updated
+        C.BODY = C.CHILD->BODY;                                 //   First body of first child
+        C.NBODY = 0;                                            //   Initialize number of bodies
+        for (Cell * Cc=C.CHILD; Cc!=C.CHILD+C.NCHILD; Cc++) C.NBODY += Cc->NBODY;// Sum over children
+      }                                                         //  End loop over cells at this level
+    }                                                           // End loop over levels
+    return nmovers;                                             // Number of re-binned bodies
   }
 }
 
@@ -0,0 +1,30 @@
+#include "exafmm.h"
+#include "fmm.h"
+
+//! C handle of an Fmm instance
+struct exafmm_t : exafmm::Fmm {
+  using exafmm::Fmm::Fmm;
+};
+
+exafmm_t * exafmm_create(int P, int ncrit, double theta, double cycle, int images) {
+  try {
+    return new exafmm_t(P, ncrit, theta, cycle, images);
+  } catch (...) {
+    return NULL;
+  }
+}
+
+void exafmm_destroy(exafmm_t * fmm) {
+  delete fmm;
+}
+
+int exafmm_evaluate(exafmm_t * fmm, int n, const double * x, const double * y, const double * z,
+                    const double * q, size_t stride, double * p, double * fx, double * fy,
+                    double * fz, size_t fstride) {
+  try {
+    fmm->evaluate(n, x, y, z, q, stride, p, fx, fy, fz, fstride);
+    return 0;
+  } catch (...) {
+    return -1;
+  }
+}
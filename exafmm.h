@@ -0,0 +1,45 @@
+#ifndef exafmm_h
+#define exafmm_h
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  //! Opaque handle of an FMM engine
+  typedef struct exafmm_t exafmm_t;
+
+  /**
+   * @brief Create an FMM engine and compute its kernel tables
+   *
+   * @param P Order of expansions, in [1, 40]
+   * @param ncrit Number of bodies per leaf cell
+   * @param theta Multipole acceptance criterion
+   * @param cycle Period of the box centered at the origin, 0 for free space
+   * @param images Number of periodic image sublevels, 0 for free space
+   * @return Engine, or NULL if the parameters are invalid or memory runs out
+   */
+  exafmm_t * exafmm_create(int P, int ncrit, double theta, double cycle, int images);
+
+  //! Destroy an engine created by exafmm_create
+  void exafmm_destroy(exafmm_t * fmm);
+
+  /**
+   * @brief Potential and force of n bodies on each other
+   *
+   * @details Body i is at (x[i*stride], y[i*stride], z[i*stride]) with charge
+   * q[i*stride], and its results are written to p[i*fstride] and fx, fy, fz at
+   * the same offset. Different engines may be called from different threads at
+   * the same time, and each call runs on the OpenMP threads of its caller. One
+   * engine must not be called from two threads at once.
+   *
+   * @return 0 on success, -1 if memory runs out
+   */
+  int exafmm_evaluate(exafmm_t * fmm, int n, const double * x, const double * y, const double * z,
+                      const double * q, size_t stride, double * p, double * fx, double * fy,
+                      double * fz, size_t fstride);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
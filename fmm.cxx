@@ -1,4 +1,6 @@
+#include "autotune.h"
 #include "build_tree.h"
+#include "io.h"
 #include "kernel.h"
 #include "timer.h"
 #include "traversal.h"
@@ -6,9 +8,22 @@ using namespace exafmm;
 
 int main(int argc, char ** argv) {
   const int numBodies = 1000;                                   // Number of bodies
-  P = 10;                                                       // Order of expansions
-  ncrit = 64;                                                   // Number of bodies per leaf cell
-  theta = 0.4;                                                  // Multipole acceptance criterion
+  const std::string mode = argc > 1 ? argv[1] : "";             // Evaluation mode
+  const bool useList = mode == "list" || mode == "batch";       // Evaluate through interaction lists
+  const bool update = mode == "update";                         // Time step with tree update
+  const bool tune = mode == "tune";                             // Autotune P, ncrit, theta
+  const bool separate = mode == "targets";                      // Probe points separate from sources
+  const bool fromFile = mode == "file";                         // Bodies from a body file, argv[2] or a test file
+  Context ctx;                                                  // Parameters and tables of the FMM
+  ctx.NRHS = mode == "rhs" ? 4 : 1;                             // Number of right-hand sides
+  ctx.images = mode == "periodic" ? 3 : 0;                      // Number of periodic image sublevels
+  ctx.cycle = ctx.images ? 2 * M_PI : 0;                        // Period of the box of bodies
+  ctx.batchM2L = mode == "batch";                               // Batched M2L from lists
+  ctx.mutual = mode == "mutual";                                // Each pair of cells once, for both cells
+  ctx.P = 10;                                                   // Order of expansions
+  ctx.ncrit = 64;                                               // Number of bodies per leaf cell
+  ctx.theta = 0.4;                                              // Multipole acceptance criterion
+  ctx.nspawn = 100;                                             // Threshold of NBODY for spawning new tasks
 
   printf("--- %-16s ------------\n", "FMM Profiling");          // Start profiling
   //! Initialize bodies
@@ -17,6 +32,7 @@ int main(int argc, char ** argv) {
   real_t average = 0;                                           // Average charge
   srand48(0);                                                   // Set seed for random number generator
   for (int b=0; b<int(bodies.size()); b++) {                    // Loop over bodies
+    bodies[b].IBODY = b;                                        //  Index before sorting
     for (int d=0; d<3; d++) {                                   //  Loop over dimension
       bodies[b].X[d] = drand48() * 2 * M_PI - M_PI;             //   Initialize positions
     }                                                           //  End loop over dimension
@@ -29,29 +45,121 @@ int main(int argc, char ** argv) {
   for (int b=0; b<int(bodies.size()); b++) {                    // Loop over bodies
     bodies[b].q -= average;                                     // Charge neutral
   }                                                             // End loop over bodies
+  ctx.Qrhs.resize(bodies.size() * (ctx.NRHS - 1));              // Charges of extra right-hand sides
+  for (int r=1; r<ctx.NRHS; r++) {                              // Loop over extra right-hand sides
+    average = 0;                                                //  Average charge
+    for (int b=0; b<int(bodies.size()); b++) {                  //  Loop over bodies
+      average += charge(ctx, bodies[b], r) = drand48() - .5;    //   Initialize and accumulate charge
+    }                                                           //  End loop over bodies
+    average /= bodies.size();                                   //  Average charge
+    for (int b=0; b<int(bodies.size()); b++) {                  //  Loop over bodies
+      charge(ctx, bodies[b], r) -= average;                     //   Charge neutral
+    }                                                           //  End loop over bodies
+  }                                                             // End loop over extra right-hand sides
+  ctx.Prhs.assign(ctx.Qrhs.size(), 0);                          // Clear potentials of extra right-hand sides
+  ctx.Frhs.assign(3 * ctx.Qrhs.size(), 0);                      // Clear forces of extra right-hand sides
+  Bodies sources;                                               // Source bodies of separate trees
+  if (separate) {                                               // If targets are probe points
+    const int ngrid = 10;                                       //  Number of probe points per dimension
+    sources = bodies;                                           //  Bodies are the sources
+    bodies.resize(ngrid * ngrid * ngrid);                       //  Bodies are the probe points
+    for (int b=0; b<int(bodies.size()); b++) {                  //  Loop over probe points
+      int ix[3] = {b % ngrid, b / ngrid % ngrid, b / ngrid / ngrid};// Grid index
+      for (int d=0; d<3; d++) bodies[b].X[d] = (ix[d] + .5) * 2 * M_PI / ngrid - M_PI;// Grid position
+      bodies[b].q = 1;                                          //   Weight of the check only, not a source
+      bodies[b].p = 0;                                          //   Clear potential
+      for (int d=0; d<3; d++) bodies[b].F[d] = 0;               //   Clear force
+    }                                                           //  End loop over probe points
+  }                                                             // End if for probe points
   stop("Initialize bodies");                                    // Stop timer
+  if (fromFile) {                                               // If bodies come from a file
+    const char * bodyFile = argc > 2 ? argv[2] : "bodies.bin";  //  Name of body file
+    if (argc <= 2) {                                            //  If no file is given
+      start("Write bodies");                                    //   Start timer
+      writeBodies(bodyFile, bodies);                            //   Random bodies as test file
+      stop("Write bodies");                                     //   Stop timer
+    }                                                           //  End if for no file
+    start("Read bodies");                                       //  Start timer
+    readBodies(bodyFile, bodies);                               //  Gather bodies from mapped file
+    stop("Read bodies");                                        //  Stop timer
+    printf("%-20s : %d\n", "Bodies", int(bodies.size()));      //  Print number of bodies
+  }                                                             // End if for body file
+  if (tune) {                                                   // If autotuning
+    start("Autotune");                                          //  Start timer
+    autotune(ctx, bodies, 1e-4);                                //  Fastest P, ncrit, theta for error bound
+    stop("Autotune");                                           //  Stop timer
+  }                                                             // End if for autotuning
 
   //! Build tree
+  initKernel(ctx);                                              // Initialize kernel
   start("Build tree");                                          // Start timer
-  Cell * cells = buildTree(bodies);                             // Build tree
+  Tree tree, jtree;                                             // Flat trees of targets and sources
+  if (separate) buildTrees(ctx, bodies, tree, sources, jtree);  // Separate target and source trees
+  else buildTree(ctx, bodies, tree);                            // Build tree
+  Cells & cells = tree.cells;                                   // Cells of tree
+  Tree & stree = separate ? jtree : tree;                       // Source tree
+  Cells & jcells = stree.cells;                                 // Cells of source tree
   stop("Build tree");                                           // Stop timer
+  if (update) {                                                 // If taking a time step
+    for (int b=0; b<int(bodies.size()); b++) {                  //  Loop over bodies
+      for (int d=0; d<3; d++) {                                 //   Loop over dimensions
+        bodies[b].X[d] = bodies[b].X[d] * .99 + (drand48() - .5) * .02;// Move inside root
+      }                                                         //   End loop over dimensions
+    }                                                           //  End loop over bodies
+    start("Update tree");                                       //  Start timer
+    int moved = updateTree(ctx, bodies, tree);                  //  Re-bin bodies that left their leaf
+    stop("Update tree");                                        //  Stop timer
+    printf("%-20s : %d\n", "Moved bodies", moved);              //  Print number of moved bodies
+  }                                                             // End if for time step
 
   //! FMM evaluation
   start("Upward pass");                                         // Start timer
-  initKernel();                                                 // Initialize kernel
-  upwardPass(cells);                                            // Upward pass for P2M, M2M
+  upwardPass(ctx, stree);                                       // Upward pass for P2M, M2M
+  if (separate) initLocal(ctx, cells);                          // Targets need no P2M, M2M
   stop("Upward pass");                                          // Stop timer
-  start("Traversal");                                           // Start timer
-  traversal(cells, cells);                                      // Traversal for M2L, P2P
-  stop("Traversal");                                            // Stop timer
+  if (useList) {                                                // If using interaction lists
+    start("Build lists");                                       //  Start timer
+    buildLists(ctx, cells, jcells);                             //  Traversal recording M2L, P2P lists
+    stop("Build lists");                                        //  Stop timer
+    start("Evaluate lists");                                    //  Start timer
+    evaluateLists(ctx, cells);                                  //  M2L, P2P from lists
+    stop("Evaluate lists");                                     //  Stop timer
+  } else {                                                      // Else traverse and evaluate at once
+    start("Traversal");                                         //  Start timer
+    traversal(ctx, cells, jcells);                              //  Traversal for M2L, P2P
+    stop("Traversal");                                          //  Stop timer
+  }                                                             // End if for interaction lists
   start("Downward pass");                                       // Start timer
-  downwardPass(cells);                                          // Downward pass for L2L, L2P
+  downwardPass(ctx, tree);                                      // Downward pass for L2L, L2P
   stop("Downward pass");                                        // Stop timer
+  if (ctx.images) dipoleCorrection(ctx, bodies, bodies);        // Tin foil boundary conditions
+  if (fromFile) {                                               // If bodies come from a file
+    const char * resultFile = argc > 3 ? argv[3] : "results.bin";// Name of result file
+    start("Write results");                                     //  Start timer
+    writeResults(resultFile, bodies);                           //  Scatter p, F to mapped file
+    stop("Write results");                                      //  Stop timer
+  }                                                             // End if for body file
+
+  //! Reuse interaction lists without traversal
+  if (useList) {                                                // If using interaction lists
+    start("Reuse lists");                                       //  Start timer
+    for (int b=0; b<int(bodies.size()); b++) {                  //  Loop over bodies
+      bodies[b].p = 0;                                          //   Clear potential
+      for (int d=0; d<3; d++) bodies[b].F[d] = 0;               //   Clear force
+    }                                                           //  End loop over bodies
+    std::fill(ctx.Prhs.begin(), ctx.Prhs.end(), 0);             //  Clear potentials of extra right-hand sides
+    std::fill(ctx.Frhs.begin(), ctx.Frhs.end(), 0);             //  Clear forces of extra right-hand sides
+    upwardPass(ctx, stree);                                     //  Upward pass for P2M, M2M
+    if (separate) initLocal(ctx, cells);                        //  Targets need no P2M, M2M
+    evaluateLists(ctx, cells);                                  //  M2L, P2P from existing lists
+    downwardPass(ctx, tree);                                    //  Downward pass for L2L, L2P
+    stop("Reuse lists");                                        //  Stop timer
+  }                                                             // End if for interaction lists
 
   //! Direct N-Body
   start("Direct N-Body");                                       // Start timer
   const int numTargets = 10;                                    // Number of targets for checking answer
-  Bodies jbodies = bodies;                                      // Save bodies in jbodies
+  Bodies jbodies = separate ? sources : bodies;                 // Save sources in jbodies
   int stride = bodies.size() / numTargets;                      // Stride of sampling
   for (int b=0; b<numTargets; b++) {                            // Loop over target samples
     bodies[b] = bodies[b*stride];                               //  Sample targets
@@ -62,7 +170,8 @@ int main(int argc, char ** argv) {
     bodies[b].p = 0;                                            //  Clear potential
     for (int d=0; d<3; d++) bodies[b].F[d] = 0;                 //  Clear force
   }                                                             // End loop over bodies
-  direct(bodies, jbodies);                                      // Direct N-Body
+  direct(ctx, bodies, jbodies);                                 // Direct N-Body
+  if (ctx.images) dipoleCorrection(ctx, bodies, jbodies);       // Tin foil boundary conditions
   stop("Direct N-Body");                                        // Stop timer
 
   //! Verify result
@@ -78,8 +187,41 @@ int main(int argc, char ** argv) {
   }                                                             // End loop over bodies & bodies2
   real_t pDif = (pSum - pSum2) * (pSum - pSum2);                // Difference in sum
   real_t pNrm = pSum * pSum;                                    // Norm of the sum
+  for (int r=1; r<ctx.NRHS; r++) {                              // Loop over extra right-hand sides
+    Bodies jbodies2 = jbodies;                                  //  Sources with the charges of r
+    for (int b=0; b<int(jbodies2.size()); b++) jbodies2[b].q = charge(ctx, jbodies[b], r);// Charge of r
+    Bodies bodies3 = bodies;                                    //  Targets with the charges of r
+    for (int b=0; b<int(bodies3.size()); b++) {                 //  Loop over targets
+      bodies3[b].q = charge(ctx, bodies[b], r);                 //   Charge of r
+      bodies3[b].p = 0;                                         //   Clear potential
+      for (int d=0; d<3; d++) bodies3[b].F[d] = 0;              //   Clear force
+    }                                                           //  End loop over targets
+    direct(ctx, bodies3, jbodies2);                             //  Direct N-Body for r
+    real_t pSum3 = 0, pSum4 = 0;                                //  Sums of potential for r
+    for (int b=0; b<int(bodies3.size()); b++) {                 //  Loop over targets
+      pSum3 += bodies3[b].p * bodies3[b].q;                     //   Direct
+      pSum4 += potential(ctx, bodies2[b], r) * bodies3[b].q;    //   FMM
+      for (int d=0; d<3; d++) {                                 //   Loop over dimensions
+        real_t dF = bodies3[b].F[d] - force(ctx, bodies2[b], r)[d];//    Difference of force
+        FDif += dF * dF;                                        //    Accumulate difference
+        FNrm += bodies3[b].F[d] * bodies3[b].F[d];              //    Accumulate norm
+      }                                                         //   End loop over dimensions
+    }                                                           //  End loop over targets
+    pDif += (pSum3 - pSum4) * (pSum3 - pSum4);                  //  Difference in sum
+    pNrm += pSum3 * pSum3;                                      //  Norm of the sum
+  }                                                             // End loop over extra right-hand sides
   printf("--- %-16s ------------\n", "FMM vs. direct");         // Print message
+  if (ctx.NRHS > 1) printf("%-20s : %d\n", "Right-hand sides", ctx.NRHS);// Errors are over all right-hand sides
+  printf("%-20s : P2P %s, M/L %s", "Precision",               // Print precision in use
+         sizeof(p2p_t) == sizeof(float) ? "float" : "double",
+         sizeof(coef_t) == sizeof(std::complex<float>) ? "float" : "double");
+  if (ctx.rsqrtNewton >= 0) printf(", rsqrt + %d Newton", ctx.rsqrtNewton);// Print rsqrt path of P2P
+  printf("\n");
   printf("%-20s : %8.5e s\n","Rel. L2 Error (p)", sqrt(pDif/pNrm));// Print potential error
   printf("%-20s : %8.5e s\n","Rel. L2 Error (F)", sqrt(FDif/FNrm));// Print force error
+#if EXAFMM_PROFILE
+  writeProfile(ctx.counters, "profile.json");                   // Write kernel counters
+  printf("%-20s : %s\n", "Kernel profile", "profile.json");    // Print file name
+#endif
   return 0;
 }
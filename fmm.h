@@ -0,0 +1,104 @@
+#ifndef fmm_h
+#define fmm_h
+#include "build_tree.h"
+#include "kernel.h"
+#include "traversal.h"
+
+namespace exafmm {
+  /**
+   * @brief FMM engine that keeps its context, tree, and bodies between calls
+   *
+   * @details Each instance owns a Context with its parameters, tables, and
+   * caches, and passes it to the tree, the traversal, and the kernels. Nothing
+   * is shared between instances, so calls of different instances can run from
+   * several threads at the same time, each on the OpenMP threads of its caller.
+   * One instance must not be called from two threads at once.
+   *
+   * Positions and charges are read from caller arrays with a stride, so both
+   * SoA (stride 1) and interleaved records are accepted as they are. They are
+   * gathered into the bodies of the tree, in tree order, and the potentials and
+   * forces are scattered back to the caller arrays through IBODY, which is one
+   * copy each way. The first call builds the tree. Later calls with the same
+   * number of bodies update it with updateTree(), which reuses the bodies,
+   * cells, and coefs. With images > 0 the result has the dipole correction, as
+   * in fmm.cxx.
+   */
+  class Fmm {
+    Context ctx;                                                //!< Parameters and tables of this instance
+    Bodies bodies;                                              //!< Bodies in tree order
+    Tree tree;                                                  //!< Tree of bodies
+
+  public:
+    /**
+     * @brief Create an engine and compute its kernel tables
+     *
+     * @param P Order of expansions, in [1, PMAX]
+     * @param ncrit Number of bodies per leaf cell
+     * @param theta Multipole acceptance criterion
+     * @param cycle Period of the box centered at the origin, 0 for free space
+     * @param images Number of periodic image sublevels, 0 for free space
+     */
+    Fmm(int P, int ncrit, real_t theta, real_t cycle=0, int images=0) {
+      ctx.P = P;                                                // Order of expansions
+      ctx.ncrit = ncrit;                                        // Number of bodies per leaf cell
+      ctx.theta = theta;                                        // Multipole acceptance criterion
+      ctx.cycle = cycle;                                        // Period of the box
+      ctx.images = images;                                      // Number of periodic image sublevels
+      ctx.nspawn = 100;                                         // Threshold for spawning tasks
+      ctx.mutual = true;                                        // Mutual self interaction
+      initKernel(ctx);                                          // Tables of instance, throws for bad P
+    }
+    Fmm(const Fmm &) = delete;                                  // Cells point into bodies
+    Fmm & operator=(const Fmm &) = delete;                      // Cells point into bodies
+
+    /**
+     * @brief Potential and force of n bodies on each other
+     *
+     * @details Body i is at (x[i*stride], y[i*stride], z[i*stride]) with charge
+     * q[i*stride], and its results go to p[i*fstride] and fx, fy, fz at the same
+     * offset. The results are overwritten, not accumulated.
+     *
+     * @param n Number of bodies
+     * @param x,y,z,q Coordinates and charges
+     * @param stride Distance between bodies in x, y, z, q
+     * @param p Potentials
+     * @param fx,fy,fz Forces
+     * @param fstride Distance between bodies in p, fx, fy, fz
+     */
+    void evaluate(int n, const real_t * x, const real_t * y, const real_t * z, const real_t * q,
+                  size_t stride, real_t * p, real_t * fx, real_t * fy, real_t * fz, size_t fstride) {
+      if (n <= 0) return;                                       // Nothing to evaluate
+      bool build = int(bodies.size()) != n;                     // Number of bodies changed
+      if (build) {                                              // If new tree
+        bodies.resize(n);                                       //  Resize bodies
+        for (int b=0; b<n; b++) bodies[b].IBODY = b;            //  Caller order
+      }                                                         // End if for new tree
+#pragma omp parallel for
+      for (int b=0; b<n; b++) {                                 // Loop over bodies in tree order
+        size_t i = bodies[b].IBODY * stride;                    //  Offset in caller arrays
+        bodies[b].X[0] = x[i];                                  //  Gather x
+        bodies[b].X[1] = y[i];                                  //  Gather y
+        bodies[b].X[2] = z[i];                                  //  Gather z
+        bodies[b].q = q[i];                                     //  Gather charge
+        bodies[b].p = 0;                                        //  Clear potential
+        for (int d=0; d<3; d++) bodies[b].F[d] = 0;             //  Clear force
+      }                                                         // End loop over bodies
+      if (build) buildTree(ctx, bodies, tree);                  // Build tree
+      else updateTree(ctx, bodies, tree);                       // Re-bin bodies that moved
+      Cells & cells = tree.cells;                               // Cells of tree
+      upwardPass(ctx, tree);                                    // Upward pass for P2M, M2M
+      traversal(ctx, cells, cells);                             // Dual tree traversal for M2L, P2P
+      downwardPass(ctx, tree);                                  // Downward pass for L2L, L2P
+      if (ctx.images) dipoleCorrection(ctx, bodies, bodies);    // Tin foil boundary conditions
+#pragma omp parallel for
+      for (int b=0; b<n; b++) {                                 // Loop over bodies in tree order
+        size_t i = bodies[b].IBODY * fstride;                   //  Offset in caller arrays
+        p[i] = bodies[b].p;                                     //  Scatter potential
+        fx[i] = bodies[b].F[0];                                 //  Scatter x force
+        fy[i] = bodies[b].F[1];                                 //  Scatter y force
+        fz[i] = bodies[b].F[2];                                 //  Scatter z force
+      }                                                         // End loop over bodies
+    }
+  };
+}
+#endif
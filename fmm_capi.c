@@ -0,0 +1,110 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "exafmm.h"
+
+//! Bodies of one engine, SoA (stride 1) or interleaved as x, y, z, q (stride 4)
+typedef struct {
+  int P;                                                        //!< Order of expansions
+  int n;                                                        //!< Number of bodies
+  size_t stride;                                                //!< Stride of inputs and outputs
+  double * in;                                                  //!< Coordinates and charges
+  double * out;                                                 //!< Potentials and forces
+  double error[2][2];                                           //!< Rel. L2 error of p and F, for each call
+  int status;                                                   //!< Nonzero if a call failed
+} Run;
+
+//! Rel. L2 error of p and F against direct summation on a few sampled targets
+void verify(Run * run, double * error) {
+  size_t s = run->stride;
+  const double * x = run->in, * y = x + (s == 1 ? run->n : 1);
+  const double * z = y + (s == 1 ? run->n : 1), * q = z + (s == 1 ? run->n : 1);
+  const double * p = run->out, * fx = p + (s == 1 ? run->n : 1);
+  const double * fy = fx + (s == 1 ? run->n : 1), * fz = fy + (s == 1 ? run->n : 1);
+  double pDif = 0, pNrm = 0, FDif = 0, FNrm = 0;
+  for (int i=0; i<run->n; i+=run->n/10) {
+    double pi = 0, F[3] = {0, 0, 0};
+    for (int j=0; j<run->n; j++) {
+      double dx = x[i*s] - x[j*s], dy = y[i*s] - y[j*s], dz = z[i*s] - z[j*s];
+      double R2 = dx * dx + dy * dy + dz * dz;
+      if (R2 == 0) continue;
+      double invR = 1 / sqrt(R2), invR3 = q[j*s] * invR * invR * invR;
+      pi += q[j*s] * invR;
+      F[0] -= dx * invR3;
+      F[1] -= dy * invR3;
+      F[2] -= dz * invR3;
+    }
+    pDif += (p[i*s] - pi) * (p[i*s] - pi);
+    pNrm += pi * pi;
+    FDif += (fx[i*s] - F[0]) * (fx[i*s] - F[0]) + (fy[i*s] - F[1]) * (fy[i*s] - F[1])
+      + (fz[i*s] - F[2]) * (fz[i*s] - F[2]);
+    FNrm += F[0] * F[0] + F[1] * F[1] + F[2] * F[2];
+  }
+  error[0] = sqrt(pDif / pNrm);
+  error[1] = sqrt(FDif / FNrm);
+}
+
+//! Create an engine, evaluate, move the bodies slightly, and evaluate again
+void * evaluate(void * arg) {
+  Run * run = (Run *) arg;
+  size_t s = run->stride;
+  size_t a = s == 1 ? run->n : 1;
+  exafmm_t * fmm = exafmm_create(run->P, 64, 0.4, 0, 0);
+  if (fmm == NULL) {
+    run->status = 1;
+    return NULL;
+  }
+  for (int step=0; step<2; step++) {
+    double * in = run->in, * out = run->out;
+    run->status |= exafmm_evaluate(fmm, run->n, in, in + a, in + 2 * a, in + 3 * a, s,
+                                   out, out + a, out + 2 * a, out + 3 * a, s);
+    verify(run, run->error[step]);
+    for (int i=0; i<run->n; i++) {
+      for (int d=0; d<3; d++) in[i*s+d*a] += ((i * 7 + d * 3) % 11 - 5) * 1e-3;
+    }
+  }
+  exafmm_destroy(fmm);
+  return NULL;
+}
+
+/**
+ * Usage: fmm_capi [bodies]
+ *
+ * Two engines with different P are evaluated from two threads, one on SoA
+ * arrays and one on interleaved records. Each engine has its own context, so
+ * the calls of the two threads run concurrently.
+ */
+int main(int argc, char ** argv) {
+  const int numBodies = argc > 1 ? atoi(argv[1]) : 2000;        // Number of bodies of each engine
+  Run runs[2] = {{6, numBodies, 1}, {10, numBodies, 4}};        // SoA with P=6, interleaved with P=10
+  srand48(0);                                                   // Set seed for random number generator
+  for (int r=0; r<2; r++) {                                     // Loop over engines
+    runs[r].in = (double *) malloc(4 * numBodies * sizeof(double));// Coordinates and charges
+    runs[r].out = (double *) malloc(4 * numBodies * sizeof(double));// Potentials and forces
+    size_t s = runs[r].stride, a = s == 1 ? numBodies : 1;      //  Stride of bodies and of components
+    double average = 0;                                         //  Average charge
+    for (int i=0; i<numBodies; i++) {                           //  Loop over bodies
+      for (int d=0; d<3; d++) runs[r].in[i*s+d*a] = drand48() * 2 * M_PI - M_PI;// Initialize positions
+      runs[r].in[i*s+3*a] = drand48() - .5;                     //   Initialize charge
+      average += runs[r].in[i*s+3*a];                           //   Accumulate charge
+    }                                                           //  End loop over bodies
+    for (int i=0; i<numBodies; i++) runs[r].in[i*s+3*a] -= average / numBodies;// Charge neutral
+  }                                                             // End loop over engines
+  pthread_t threads[2];                                         // One thread per engine
+  for (int r=0; r<2; r++) pthread_create(&threads[r], NULL, evaluate, &runs[r]);// Start engines
+  for (int r=0; r<2; r++) pthread_join(threads[r], NULL);       // Wait for engines
+  printf("--- %-16s ------------\n", "C API vs. direct");        // Print message
+  for (int r=0; r<2; r++) {                                     // Loop over engines
+    for (int step=0; step<2; step++) {                          //  Loop over calls
+      char name[32];                                            //   Label of error
+      snprintf(name, sizeof(name), "P=%d call %d (p)", runs[r].P, step);
+      printf("%-20s : %8.5e s\n", name, runs[r].error[step][0]);// Print potential error
+      snprintf(name, sizeof(name), "P=%d call %d (F)", runs[r].P, step);
+      printf("%-20s : %8.5e s\n", name, runs[r].error[step][1]);// Print force error
+    }                                                           //  End loop over calls
+    free(runs[r].in);                                           //  Free inputs
+    free(runs[r].out);                                          //  Free outputs
+  }                                                             // End loop over engines
+  return runs[0].status || runs[1].status;                      // Fail if a call failed
+}
@@ -0,0 +1,146 @@
+#include "build_tree.h"
+#include "kernel.h"
+#include "local_essential_tree.h"
+#include "partition.h"
+#include "timer.h"
+#include "traversal.h"
+using namespace exafmm;
+
+//! Print the time of an event on rank 0, after all ranks are done with it
+void stopMPI(std::string event) {
+  MPI_Barrier(MPI_COMM_WORLD);                                  // Wait for the slowest rank
+  if (mpirank == 0) stop(event);                                // Print time
+}
+
+/**
+ * Usage: mpirun -np N fmm_mpi [bodies per rank]
+ *
+ * Each rank starts with random bodies in the whole cube, so the partition
+ * moves most of them. The communication volume and time of each rank are
+ * printed by rank 0.
+ */
+int main(int argc, char ** argv) {
+  initMPI(&argc, &argv);                                        // Initialize MPI
+  const int numBodies = argc > 1 ? atoi(argv[1]) : 1000;        // Number of bodies per rank
+  Context ctx;                                                  // Parameters and tables of the FMM
+  ctx.images = 0;                                               // Free space only
+  ctx.cycle = 0;                                                // No period
+  ctx.P = 10;                                                   // Order of expansions
+  ctx.ncrit = 64;                                               // Number of bodies per leaf cell
+  ctx.theta = 0.4;                                              // Multipole acceptance criterion
+  ctx.nspawn = 100;                                             // Threshold of NBODY for spawning new tasks
+  CommStats stats = {0, 0, 0, 0, 0};                            // Communication of this rank
+
+  if (mpirank == 0) printf("--- %-16s ------------\n", "FMM Profiling");// Start profiling
+  if (mpirank == 0) printf("%-20s : %d\n", "Ranks", mpisize);   // Print number of ranks
+  //! Initialize bodies
+  start("Initialize bodies");                                   // Start timer
+  Bodies bodies(numBodies);                                     // Initialize bodies
+  real_t average = 0;                                           // Average charge
+  srand48(mpirank);                                             // Different bodies on each rank
+  for (int b=0; b<int(bodies.size()); b++) {                    // Loop over bodies
+    bodies[b].IBODY = mpirank * numBodies + b;                  //  Global index
+    for (int d=0; d<3; d++) {                                   //  Loop over dimension
+      bodies[b].X[d] = drand48() * 2 * M_PI - M_PI;             //   Initialize positions
+    }                                                           //  End loop over dimension
+    bodies[b].q = drand48() - .5;                               //  Initialize charge
+    average += bodies[b].q;                                     //  Accumulate charge
+    bodies[b].p = 0;                                            //  Clear potential
+    for (int d=0; d<3; d++) bodies[b].F[d] = 0;                 //  Clear force
+  }                                                             // End loop over bodies
+  average /= bodies.size();                                     // Average charge
+  for (int b=0; b<int(bodies.size()); b++) {                    // Loop over bodies
+    bodies[b].q -= average;                                     // Charge neutral
+  }                                                             // End loop over bodies
+  stopMPI("Initialize bodies");                                 // Stop timer
+
+  //! Partition bodies and build local tree
+  initKernel(ctx);                                              // Initialize kernel
+  start("Partition");                                           // Start timer
+  double t0 = MPI_Wtime();                                      // Time of this rank
+  real_t R0, X0[3];                                             // Radius and center of global root
+  getGlobalBounds(ctx, bodies, R0, X0);                         // Common root box of all ranks
+  partition(bodies, X0, R0, stats.partitionBytes);              // Send bodies to their owners
+  stats.partitionTime = MPI_Wtime() - t0;                       // Time of this rank
+  stopMPI("Partition");                                         // Stop timer
+  start("Build tree");                                          // Start timer
+  Tree tree;                                                    // Local tree
+  buildTree(ctx, bodies, tree, X0, R0);                         // Build tree in global root box
+  Cells & cells = tree.cells;                                   // Cells of local tree
+  stopMPI("Build tree");                                        // Stop timer
+
+  //! FMM evaluation
+  start("Upward pass");                                         // Start timer
+  upwardPass(ctx, tree);                                        // Upward pass for P2M, M2M
+  stopMPI("Upward pass");                                       // Stop timer
+  start("Exchange LET");                                        // Start timer
+  t0 = MPI_Wtime();                                             // Time of this rank
+  std::vector<Tree> lets;                                       // Imported trees of each rank
+  exchangeLET(ctx, bodies, cells, lets, stats);                 // Send and receive local essential trees
+  stats.letTime = MPI_Wtime() - t0;                             // Time of this rank
+  stopMPI("Exchange LET");                                      // Stop timer
+  start("Traversal");                                           // Start timer
+  traversalLET(ctx, cells, lets);                               // Traversal for M2L, P2P
+  stopMPI("Traversal");                                         // Stop timer
+  start("Downward pass");                                       // Start timer
+  downwardPass(ctx, tree);                                      // Downward pass for L2L, L2P
+  stopMPI("Downward pass");                                     // Stop timer
+
+  //! Communication of each rank
+  std::vector<CommStats> allStats(mpisize);                     // Statistics of all ranks
+  MPI_Gather(&stats, sizeof(CommStats), MPI_BYTE, allStats.data(), sizeof(CommStats), MPI_BYTE, 0, MPI_COMM_WORLD);
+  if (mpirank == 0) {                                           // If rank 0
+    printf("--- %-16s ------------\n", "Communication");        //  Print message
+    printf("%4s %10s %12s %10s %12s %10s\n", "rank", "part [s]", "bodies [KB]", "LET [s]", "LET [KB]", "LET cells");
+    for (int i=0; i<mpisize; i++) {                             //  Loop over ranks
+      printf("%4d %10.6f %12.1f %10.6f %12.1f %10d\n", i, allStats[i].partitionTime,
+             allStats[i].partitionBytes / 1024, allStats[i].letTime, allStats[i].letBytes / 1024,
+             int(allStats[i].letCells));
+    }                                                           //  End loop over ranks
+  }                                                             // End if for rank 0
+
+  //! Direct N-Body
+  start("Direct N-Body");                                       // Start timer
+  const int numTargets = 10;                                    // Number of targets for checking answer per rank
+  int localSize = bodies.size() * sizeof(Body);                 // Bytes of local bodies
+  std::vector<int> sizes(mpisize), displs(mpisize, 0);          // Bytes and offsets of each rank
+  MPI_Allgather(&localSize, 1, MPI_INT, sizes.data(), 1, MPI_INT, MPI_COMM_WORLD);// Gather sizes
+  for (int i=1; i<mpisize; i++) displs[i] = displs[i-1] + sizes[i-1];// Scan sizes
+  Bodies jbodies((displs[mpisize-1] + sizes[mpisize-1]) / sizeof(Body));// Bodies of all ranks
+  MPI_Allgatherv(bodies.data(), localSize, MPI_BYTE, jbodies.data(), sizes.data(), displs.data(),
+                 MPI_BYTE, MPI_COMM_WORLD);                     // Gather sources
+  int stride = std::max(int(bodies.size()) / numTargets, 1);    // Stride of sampling
+  int ntargets = std::min(numTargets, int(bodies.size()));      // Number of local samples
+  for (int b=0; b<ntargets; b++) {                              // Loop over target samples
+    bodies[b] = bodies[b*stride];                               //  Sample targets
+  }                                                             // End loop over target samples
+  bodies.resize(ntargets);                                      // Resize bodies
+  Bodies bodies2 = bodies;                                      // Backup bodies
+  for (int b=0; b<int(bodies.size()); b++) {                    // Loop over bodies
+    bodies[b].p = 0;                                            //  Clear potential
+    for (int d=0; d<3; d++) bodies[b].F[d] = 0;                 //  Clear force
+  }                                                             // End loop over bodies
+  direct(ctx, bodies, jbodies);                                 // Direct N-Body
+  stopMPI("Direct N-Body");                                     // Stop timer
+
+  //! Verify result
+  double sums[4] = {0, 0, 0, 0}, globalSums[4];                 // pSum, pSum2, FDif, FNrm
+  for (int b=0; b<int(bodies.size()); b++) {                    // Loop over bodies & bodies2
+    sums[0] += bodies[b].p * bodies[b].q;                       //  Sum of potential for bodies
+    sums[1] += bodies2[b].p * bodies2[b].q;                     //  Sum of potential for bodies2
+    for (int d=0; d<3; d++) {                                   //  Loop over dimensions
+      sums[2] += (bodies[b].F[d] - bodies2[b].F[d]) * (bodies[b].F[d] - bodies2[b].F[d]);// Difference of force
+      sums[3] += bodies[b].F[d] * bodies[b].F[d];               //   Value of force
+    }                                                           //  End loop over dimensions
+  }                                                             // End loop over bodies & bodies2
+  MPI_Reduce(sums, globalSums, 4, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);// Sum over ranks
+  if (mpirank == 0) {                                           // If rank 0
+    real_t pDif = (globalSums[0] - globalSums[1]) * (globalSums[0] - globalSums[1]);// Difference in sum
+    real_t pNrm = globalSums[0] * globalSums[0];                //  Norm of the sum
+    printf("--- %-16s ------------\n", "FMM vs. direct");       //  Print message
+    printf("%-20s : %8.5e s\n","Rel. L2 Error (p)", sqrt(pDif/pNrm));// Print potential error
+    printf("%-20s : %8.5e s\n","Rel. L2 Error (F)", sqrt(globalSums[2]/globalSums[3]));// Print force error
+  }                                                             // End if for rank 0
+  MPI_Finalize();                                               // Finalize MPI
+  return 0;
+}
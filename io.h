@@ -0,0 +1,188 @@
+#ifndef io_h
+#define io_h
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "types.h"
+
+namespace exafmm {
+  const char bodyFileMagic[8] = {'E', 'X', 'A', 'F', 'M', 'M', 'B', '1'};//!< First bytes of a body file
+  enum BodyFileContent { bodyFileBodies, bodyFileResults };     //!< x, y, z, q or p, Fx, Fy, Fz blocks
+
+  /**
+   * @brief Header of a binary body file
+   *
+   * @details The header is followed by four blocks of numBodies doubles in
+   * native byte order: x, y, z, q for bodies, or p, Fx, Fy, Fz for results.
+   * The header is 64 bytes, so the blocks are aligned for SIMD loads.
+   */
+  struct BodyFileHeader {
+    char magic[8];                                              //!< bodyFileMagic
+    int64_t numBodies;                                          //!< Number of bodies
+    int64_t content;                                            //!< BodyFileContent
+    int64_t reserved[5];                                        //!< Zero, pads the header to 64 bytes
+  };
+
+  //! Memory mapping of a whole file
+  struct MappedFile {
+    char * data;                                                //!< First byte of mapping
+    size_t size;                                                //!< Size of file in bytes
+  };
+
+  //! Unmap a file, with its dirty pages written to disk first if sync is set
+  void unmapFile(MappedFile & file, bool sync=false) {
+    if (sync) msync(file.data, file.size, MS_SYNC);             // Write back dirty pages
+    munmap(file.data, file.size);                               // Release mapping
+    file.data = NULL;                                           // Mark as unmapped
+  }
+
+  /**
+   * @brief Map a body file for reading
+   *
+   * @details The pages are read in by mmap with MAP_POPULATE, so the caller
+   * accesses the blocks at memory speed, and the time of the call is the time
+   * of the file I/O. The number of bodies in the header is checked against the
+   * size of the file before any offset is computed from it.
+   *
+   * @param filename Name of file
+   * @param content Expected BodyFileContent
+   * @param n Number of bodies
+   * @param file Mapping, to be released with unmapFile()
+   * @return First of the four blocks, each of n doubles
+   */
+  const double * mapBodyFile(const char * filename, int64_t content, int64_t & n, MappedFile & file) {
+    int fd = open(filename, O_RDONLY);                          // Open file
+    if (fd < 0) throw std::runtime_error(std::string("cannot open ") + filename);// Check open
+    struct stat st;                                             // File status
+    if (fstat(fd, &st) < 0) {                                   // If size of file is unknown
+      close(fd);                                                //  Close file
+      throw std::runtime_error(std::string("cannot stat ") + filename);// Report file
+    }                                                           // End if for status
+    file.size = st.st_size;                                     // Size of file
+    if (file.size < sizeof(BodyFileHeader)) {                   // If too small for header
+      close(fd);                                                //  Close file
+      throw std::runtime_error(std::string("not a body file: ") + filename);// Report file
+    }                                                           // End if for size
+    void * ptr = mmap(NULL, file.size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);// Map and read in pages
+    close(fd);                                                  // Mapping keeps the file open
+    if (ptr == MAP_FAILED) throw std::runtime_error(std::string("cannot map ") + filename);// Check mapping
+    file.data = static_cast<char *>(ptr);                       // First byte of mapping
+    const BodyFileHeader * header = reinterpret_cast<const BodyFileHeader *>(file.data);// Header
+    n = header->numBodies;                                      // Number of bodies
+    size_t maxBodies = (file.size - sizeof(BodyFileHeader)) / (4 * sizeof(double));// Bodies that fit in file
+    if (std::memcmp(header->magic, bodyFileMagic, 8) || header->content != content || n < 0 ||
+        uint64_t(n) > maxBodies) {                              // If header does not match
+      unmapFile(file);                                          //  Release mapping
+      throw std::runtime_error(std::string("not a body file: ") + filename);// Report file
+    }                                                           // End if for header
+    return reinterpret_cast<const double *>(file.data + sizeof(BodyFileHeader));// First block
+  }
+
+  /**
+   * @brief Create a body file of n bodies and map it for writing
+   *
+   * @details The mapping is shared, so stores into the blocks go to the page
+   * cache and are written back by the kernel, and unmapFile() with sync waits
+   * for the rest.
+   *
+   * @param filename Name of file, replaced if it exists
+   * @param content BodyFileContent
+   * @param n Number of bodies
+   * @param file Mapping, to be released with unmapFile()
+   * @return First of the four blocks, each of n doubles
+   */
+  double * createBodyFile(const char * filename, int64_t content, int64_t n, MappedFile & file) {
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);  // Create file
+    if (fd < 0) throw std::runtime_error(std::string("cannot create ") + filename);// Check open
+    file.size = sizeof(BodyFileHeader) + 4 * n * sizeof(double);// Size of file
+    void * ptr = MAP_FAILED;                                    // Mapping
+    if (ftruncate(fd, file.size) == 0) {                        // If file is resized
+      ptr = mmap(NULL, file.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);// Map for writing
+    }                                                           // End if for resize
+    close(fd);                                                  // Mapping keeps the file open
+    if (ptr == MAP_FAILED) throw std::runtime_error(std::string("cannot map ") + filename);// Check mapping
+    file.data = static_cast<char *>(ptr);                       // First byte of mapping
+    BodyFileHeader * header = reinterpret_cast<BodyFileHeader *>(file.data);// Header
+    std::memset(header, 0, sizeof(BodyFileHeader));             // Zero reserved fields
+    std::memcpy(header->magic, bodyFileMagic, 8);               // Magic
+    header->numBodies = n;                                      // Number of bodies
+    header->content = content;                                  // Content of blocks
+    return reinterpret_cast<double *>(file.data + sizeof(BodyFileHeader));// First block
+  }
+
+  /**
+   * @brief Read bodies from a body file
+   *
+   * @details The FMM works on an array of Body structs, which buildTree()
+   * sorts in place, so the blocks cannot be used directly. Positions and
+   * charges are copied from the mapped blocks into the bodies in one parallel
+   * pass, and IBODY is the index in the file. The copy replaces the parsing of
+   * a text file, not the array of bodies.
+   *
+   * @param filename Name of file
+   * @param bodies Bodies, resized to the number in the file
+   */
+  void readBodies(const char * filename, Bodies & bodies) {
+    MappedFile file;                                            // Mapping of file
+    int64_t n;                                                  // Number of bodies
+    const double * x = mapBodyFile(filename, bodyFileBodies, n, file);// Map file
+    if (n > INT_MAX) {                                          // If IBODY cannot index the bodies
+      unmapFile(file);                                          //  Release mapping
+      throw std::runtime_error(std::string("too many bodies in ") + filename);// Report file
+    }                                                           // End if for size
+    bodies.resize(n);                                           // One body per entry
+#pragma omp parallel for
+    for (int b=0; b<int(n); b++) {                              // Loop over bodies
+      bodies[b].IBODY = b;                                      //  Index in file
+      for (int d=0; d<3; d++) bodies[b].X[d] = x[d*n+b];        //  Position from x, y, z blocks
+      bodies[b].q = x[3*n+b];                                   //  Charge from q block
+      bodies[b].p = 0;                                          //  Clear potential
+      for (int d=0; d<3; d++) bodies[b].F[d] = 0;               //  Clear force
+    }                                                           // End loop over bodies
+    unmapFile(file);                                            // Release mapping
+  }
+
+  //! Write positions and charges of bodies, in vector order, to a body file
+  void writeBodies(const char * filename, const Bodies & bodies) {
+    MappedFile file;                                            // Mapping of file
+    int64_t n = bodies.size();                                  // Number of bodies
+    double * x = createBodyFile(filename, bodyFileBodies, n, file);// Create and map file
+#pragma omp parallel for
+    for (int b=0; b<int(n); b++) {                              // Loop over bodies
+      for (int d=0; d<3; d++) x[d*n+b] = bodies[b].X[d];        //  Position to x, y, z blocks
+      x[3*n+b] = bodies[b].q;                                   //  Charge to q block
+    }                                                           // End loop over bodies
+    unmapFile(file, true);                                      // Write back and release mapping
+  }
+
+  /**
+   * @brief Write potentials and forces to a result file, in the order of the body file
+   *
+   * @details The bodies are in tree order, and each is stored at its IBODY in
+   * the mapped blocks, so the results are copied once from the bodies into the
+   * page cache. The write is not streamed. The dirty pages are written back by
+   * msync in unmapFile() after the loop, and the time of the call includes it.
+   *
+   * @param filename Name of file
+   * @param bodies Bodies with IBODY from readBodies()
+   */
+  void writeResults(const char * filename, const Bodies & bodies) {
+    MappedFile file;                                            // Mapping of file
+    int64_t n = bodies.size();                                  // Number of bodies
+    double * p = createBodyFile(filename, bodyFileResults, n, file);// Create and map file
+#pragma omp parallel for
+    for (int b=0; b<int(n); b++) {                              // Loop over bodies in tree order
+      int i = bodies[b].IBODY;                                  //  Index in file
+      p[i] = bodies[b].p;                                       //  Potential to p block
+      for (int d=0; d<3; d++) p[(d+1)*n+i] = bodies[b].F[d];    //  Force to Fx, Fy, Fz blocks
+    }                                                           // End loop over bodies
+    unmapFile(file, true);                                      // Write back and release mapping
+  }
+}
+#endif
@@ -1,15 +1,59 @@
+#include <cassert>
+#include <omp.h>
 #include "kernel.h"
 using namespace exafmm;
 
+//! Reference solid harmonics with std::exp and division by sin(alpha) in the inner loop
+void evalMultipoleRef(const Context & ctx, real_t rho, real_t alpha, real_t beta,
+                      complex_t * Ynm, complex_t * YnmTheta) {
+  real_t x = std::cos(alpha);
+  real_t y = std::sin(alpha);
+  real_t fact = 1;
+  real_t pn = 1;
+  real_t rhom = 1;
+  for (int m=0; m<ctx.P; m++) {
+    complex_t eim = std::exp(I * real_t(m * beta));
+    real_t p = pn;
+    int npn = m * m + 2 * m;
+    int nmn = m * m;
+    Ynm[npn] = rhom * p * ctx.prefactor[npn] * eim;
+    Ynm[nmn] = std::conj(Ynm[npn]);
+    real_t p1 = p;
+    p = x * (2 * m + 1) * p1;
+    YnmTheta[npn] = rhom * (p - (m + 1) * x * p1) / y * ctx.prefactor[npn] * eim;
+    rhom *= rho;
+    real_t rhon = rhom;
+    for (int n=m+1; n<ctx.P; n++) {
+      int npm = n * n + n + m;
+      int nmm = n * n + n - m;
+      Ynm[npm] = rhon * p * ctx.prefactor[npm] * eim;
+      Ynm[nmm] = std::conj(Ynm[npm]);
+      real_t p2 = p1;
+      p1 = p;
+      p = (x * (2 * n + 1) * p1 - (n + m) * p2) / (n - m + 1);
+      YnmTheta[npm] = rhon * ((n - m + 1) * p - (n + 1) * x * p1) / y * ctx.prefactor[npm] * eim;
+      rhon *= rho;
+    }
+    pn = -pn * fact * y;
+    fact += 2;
+  }
+}
+
 int main(int argc, char ** argv) {
-  P = atoi(argv[1]);
-  initKernel();
+  Context ctx;
+  ctx.P = atoi(argv[1]);
+  initKernel(ctx);
 
   // P2M
   Bodies jbodies(1);
   for (int d=0; d<3; d++) jbodies[0].X[d] = 2;
   jbodies[0].q = 1;
-  Cells cells(4);
+  Cells cells(8);
+  std::vector<coef_t> coefs(2*cells.size()*ctx.NTERM, 0.0);
+  for (int c=0; c<int(cells.size()); c++) {
+    cells[c].M = &coefs[2*c*ctx.NTERM];
+    cells[c].L = &coefs[(2*c+1)*ctx.NTERM];
+  }
   Cell * Cj = &cells[0];
   Cj->X[0] = 3;
   Cj->X[1] = 1;
@@ -17,8 +61,7 @@ int main(int argc, char ** argv) {
   Cj->R = 1;
   Cj->BODY = &jbodies[0];
   Cj->NBODY = jbodies.size();
-  Cj->M.resize(NTERM, 0.0);
-  P2M(Cj);
+  P2M(ctx, Cj);
 
   // M2M
   Cell * CJ = &cells[1];
@@ -28,8 +71,7 @@ int main(int argc, char ** argv) {
   CJ->X[1] = 0;
   CJ->X[2] = 0;
   CJ->R = 2;
-  CJ->M.resize(NTERM, 0.0);
-  M2M(CJ);
+  M2M(ctx, CJ);
 
   // M2L
   Cell * CI = &cells[2];
@@ -37,9 +79,36 @@ int main(int argc, char ** argv) {
   CI->X[1] = 0;
   CI->X[2] = 0;
   CI->R = 2;
-  CI->L.resize(NTERM, 0.0);
-  M2L(CI, CJ);
-  
+  M2L(ctx, CI, CJ);
+
+  // M2L by rotation
+  Cell * Ca = &cells[4];
+  Cell * Cb = &cells[5];
+  Ca->X[0] = Cb->X[0] = -4;
+  Ca->X[1] = Cb->X[1] = 1.5;
+  Ca->X[2] = Cb->X[2] = -0.7;
+  M2L(ctx, Ca, CJ);
+  ctx.rotateM2L = true;
+  M2L(ctx, Cb, CJ);
+  ctx.rotateM2L = false;
+  real_t M2LDif = 0, M2LNrm = 0;
+  for (int n=0; n<ctx.NTERM; n++) {
+    M2LDif += std::norm(Ca->L[n] - Cb->L[n]);
+    M2LNrm += std::norm(Ca->L[n]);
+  }
+
+  // M2L by the kernel specialized for P, e.g. M2L<10, 1>, against the generic kernel
+  Cell * Cc = &cells[6];
+  Cell * Cd = &cells[7];
+  for (int d=0; d<3; d++) Cc->X[d] = Cd->X[d] = Ca->X[d];
+  M2L<0, 1>(ctx, Cc, CJ);
+  EXAFMM_DISPATCH_NR(M2L, 1, ctx, Cd, CJ);
+  real_t genericDif = 0, genericNrm = 0;
+  for (int n=0; n<ctx.NTERM; n++) {
+    genericDif += std::norm(Cd->L[n] - Cc->L[n]);
+    genericNrm += std::norm(Cc->L[n]);
+  }
+
   // L2L
   Cell * Ci = &cells[3];
   CI->CHILD = Ci;
@@ -48,8 +117,7 @@ int main(int argc, char ** argv) {
   Ci->X[1] = 1;
   Ci->X[2] = 1;
   Ci->R = 1;
-  Ci->L.resize(NTERM, 0.0);
-  L2L(CI);
+  L2L(ctx, CI);
 
   // L2P
   Bodies bodies(1);
@@ -61,7 +129,7 @@ int main(int argc, char ** argv) {
   for (int d=0; d<3; d++) bodies[0].F[d] = 0;
   Ci->BODY = &bodies[0];
   Ci->NBODY = bodies.size();
-  L2P(Ci);
+  L2P(ctx, Ci);
 
   // P2P
   Bodies bodies2(1);
@@ -73,7 +141,189 @@ int main(int argc, char ** argv) {
   Cj->NBODY = jbodies.size();
   Ci->NBODY = bodies2.size();
   Ci->BODY = &bodies2[0];
-  P2P(Ci, Cj);
+  packSources(ctx, Cj);
+  P2P(ctx, Ci, Cj);
+
+  // Harmonics, block P2M and block L2P against the reference harmonics
+  srand48(0);
+  Bodies leaf(100);
+  for (int b=0; b<int(leaf.size()); b++) {
+    for (int d=0; d<3; d++) leaf[b].X[d] = drand48() * 2 - 1;
+    leaf[b].q = drand48() - .5;
+    leaf[b].p = 0;
+    for (int d=0; d<3; d++) leaf[b].F[d] = 0;
+  }
+  Cells leafCells(1);
+  Cell * Cl = &leafCells[0];
+  for (int d=0; d<3; d++) Cl->X[d] = 0;
+  Cl->R = 1;
+  Cl->BODY = &leaf[0];
+  Cl->NBODY = leaf.size();
+  std::vector<coef_t> Mleaf(ctx.NTERM, 0.0);
+  std::vector<complex_t> Mref(ctx.NTERM, 0.0);
+  Cl->M = &Mleaf[0];
+  Cl->L = &Mleaf[0];
+  P2M(ctx, Cl);
+  std::vector<complex_t> Ynm(ctx.P*ctx.P), YnmTheta(ctx.P*ctx.P), Yref(ctx.P*ctx.P), YrefTheta(ctx.P*ctx.P);
+  real_t YDif = 0, YNrm = 0;
+  Bodies leafRef = leaf;
+  for (int b=0; b<int(leaf.size()); b++) {
+    real_t r, theta, phi;
+    cart2sph(leaf[b].X, r, theta, phi);
+    evalMultipole(ctx, r, theta, phi, &Ynm[0], &YnmTheta[0]);
+    evalMultipoleRef(ctx, r, theta, phi, &Yref[0], &YrefTheta[0]);
+    for (int nm=0; nm<ctx.P*ctx.P; nm++) {
+      YDif += std::norm(Ynm[nm] - Yref[nm]) + std::norm(YnmTheta[nm] - YrefTheta[nm]);
+      YNrm += std::norm(Yref[nm]) + std::norm(YrefTheta[nm]);
+    }
+    evalMultipoleRef(ctx, r, theta, -phi, &Yref[0], &YrefTheta[0]);
+    for (int n=0; n<ctx.P; n++) {
+      for (int m=0; m<=n; m++) {
+        Mref[n*(n+1)/2+m] += leaf[b].q * Yref[n*n+n+m];
+      }
+    }
+    evalMultipoleRef(ctx, r, theta, phi, &Yref[0], &YrefTheta[0]);
+    real_t spherical[3] = {0, 0, 0}, cartesian[3] = {0, 0, 0};
+    for (int n=0; n<ctx.P; n++) {
+      for (int m=0; m<=n; m++) {
+        int nm = n * n + n + m;
+        real_t w = m ? 2 : 1;
+        complex_t L = Mleaf[n*(n+1)/2+m];
+        leafRef[b].p += w * std::real(L * Yref[nm]);
+        spherical[0] += w * std::real(L * Yref[nm]) / r * n;
+        spherical[1] += w * std::real(L * YrefTheta[nm]);
+        spherical[2] += w * std::real(L * Yref[nm] * I) * m;
+      }
+    }
+    sph2cart(r, theta, phi, spherical, cartesian);
+    for (int d=0; d<3; d++) leafRef[b].F[d] += cartesian[d];
+  }
+  real_t MDif = 0, MNrm = 0;
+  for (int n=0; n<ctx.NTERM; n++) {
+    MDif += std::norm(complex_t(Mleaf[n]) - Mref[n]);
+    MNrm += std::norm(Mref[n]);
+  }
+  L2P(ctx, Cl);
+  real_t leafDif = 0, leafNrm = 0;
+  for (int b=0; b<int(leaf.size()); b++) {
+    leafDif += (leaf[b].p - leafRef[b].p) * (leaf[b].p - leafRef[b].p);
+    leafNrm += leafRef[b].p * leafRef[b].p;
+    for (int d=0; d<3; d++) {
+      leafDif += (leaf[b].F[d] - leafRef[b].F[d]) * (leaf[b].F[d] - leafRef[b].F[d]);
+      leafNrm += leafRef[b].F[d] * leafRef[b].F[d];
+    }
+  }
+
+  // P2P with rsqrt estimate and Newton steps, against exact P2P
+  Bodies cloud(256);
+  for (int b=0; b<int(cloud.size()); b++) {
+    for (int d=0; d<3; d++) cloud[b].X[d] = drand48();
+    cloud[b].q = drand48() - .5;
+  }
+  Cells cloudCells(2);
+  Cell * Ct = &cloudCells[0];
+  Cell * Cs = &cloudCells[1];
+  Ct->NBODY = Cs->NBODY = cloud.size();
+  Cs->BODY = &cloud[0];
+  packSources(ctx, Cs);
+  const int reps = 100;
+  real_t rsqrtErr[5], rsqrtTime[5];
+  Bodies cloudExact;
+  for (int newton=-1; newton<=3; newton++) {
+    Bodies targets = cloud;
+    for (int b=0; b<int(targets.size()); b++) {
+      targets[b].p = 0;
+      for (int d=0; d<3; d++) targets[b].F[d] = 0;
+    }
+    Ct->BODY = &targets[0];
+    ctx.rsqrtNewton = newton;
+    double t0 = omp_get_wtime();
+    for (int r=0; r<reps; r++) P2P(ctx, Ct, Cs);
+    rsqrtTime[newton+1] = (omp_get_wtime() - t0) / reps / cloud.size() / cloud.size();
+    if (newton == -1) cloudExact = targets;
+    real_t dif = 0, nrm = 0;
+    for (int b=0; b<int(targets.size()); b++) {
+      dif += (targets[b].p - cloudExact[b].p) * (targets[b].p - cloudExact[b].p);
+      nrm += cloudExact[b].p * cloudExact[b].p;
+      for (int d=0; d<3; d++) {
+        dif += (targets[b].F[d] - cloudExact[b].F[d]) * (targets[b].F[d] - cloudExact[b].F[d]);
+        nrm += cloudExact[b].F[d] * cloudExact[b].F[d];
+      }
+    }
+    rsqrtErr[newton+1] = std::sqrt(dif/nrm);
+  }
+  ctx.rsqrtNewton = EXAFMM_RSQRT_NEWTON;
+
+  // P2P in single precision on the cloud, against exact P2P in double precision summed reps times
+  std::vector<float, AlignedAllocator<float> > SRC(Cs->SRC.begin(), Cs->SRC.end());
+  int npad = SRC.size() / 4;
+  real_t potDifF = 0, potNrmF = 0, accDifF = 0, accNrmF = 0;
+  for (int b=0; b<int(cloud.size()); b++) {
+    float X[3] = {float(cloud[b].X[0]), float(cloud[b].X[1]), float(cloud[b].X[2])};
+    float pot = 0, F[3] = {0, 0, 0};
+    P2P(X, &SRC[0], &SRC[npad], &SRC[2*npad], &SRC[3*npad], npad, pot, F);
+    real_t potExact = cloudExact[b].p / reps;
+    potDifF += (pot - potExact) * (pot - potExact);
+    potNrmF += potExact * potExact;
+    for (int d=0; d<3; d++) {
+      real_t accExact = cloudExact[b].F[d] / reps;
+      accDifF += (F[d] - accExact) * (F[d] - accExact);
+      accNrmF += accExact * accExact;
+    }
+  }
+
+  // Mutual P2P and M2L against one-sided P2P and M2L in both directions
+  Bodies pair = cloud;
+  for (int b=0; b<int(pair.size()); b++) {
+    if (b >= int(pair.size()) / 2) pair[b].X[0] += 2;
+    pair[b].p = 0;
+    for (int d=0; d<3; d++) pair[b].F[d] = 0;
+  }
+  Bodies pairRef = pair;
+  Cells pairCells(2);
+  Cell * Cp = &pairCells[0];
+  Cell * Cq = &pairCells[1];
+  Cp->NBODY = Cq->NBODY = pair.size() / 2;
+  Cp->BODY = &pair[0];
+  Cq->BODY = &pair[Cp->NBODY];
+  for (int d=0; d<3; d++) Cp->X[d] = .5;
+  Cq->X[0] = 2.6;
+  Cq->X[1] = .3;
+  Cq->X[2] = .7;
+  Cp->R = Cq->R = .5;
+  std::vector<coef_t> pairCoefs(4*ctx.NTERM, 0.0);
+  Cp->M = &pairCoefs[0];
+  Cp->L = &pairCoefs[ctx.NTERM];
+  Cq->M = &pairCoefs[2*ctx.NTERM];
+  Cq->L = &pairCoefs[3*ctx.NTERM];
+  packSources(ctx, Cp);
+  packSources(ctx, Cq);
+  P2M(ctx, Cp);
+  P2M(ctx, Cq);
+  P2Pmutual(ctx, Cp, Cq);
+  M2Lmutual(ctx, Cp, Cq);
+  std::vector<coef_t> Lmutual(pairCoefs);
+  Cp->BODY = &pairRef[0];
+  Cq->BODY = &pairRef[Cp->NBODY];
+  std::fill(Cp->L, Cp->L+ctx.NTERM, coef_t(0));
+  std::fill(Cq->L, Cq->L+ctx.NTERM, coef_t(0));
+  P2P(ctx, Cp, Cq);
+  P2P(ctx, Cq, Cp);
+  M2L(ctx, Cp, Cq);
+  M2L(ctx, Cq, Cp);
+  real_t mutualDif = 0, mutualNrm = 0, mutualM2LDif = 0, mutualM2LNrm = 0;
+  for (int b=0; b<int(pair.size()); b++) {
+    mutualDif += (pair[b].p - pairRef[b].p) * (pair[b].p - pairRef[b].p);
+    mutualNrm += pairRef[b].p * pairRef[b].p;
+    for (int d=0; d<3; d++) {
+      mutualDif += (pair[b].F[d] - pairRef[b].F[d]) * (pair[b].F[d] - pairRef[b].F[d]);
+      mutualNrm += pairRef[b].F[d] * pairRef[b].F[d];
+    }
+  }
+  for (int n=0; n<4*ctx.NTERM; n++) {
+    mutualM2LDif += std::norm(complex_t(Lmutual[n] - pairCoefs[n]));
+    mutualM2LNrm += std::norm(complex_t(pairCoefs[n]));
+  }
 
   // Verify results
   real_t potDif = 0, potNrm = 0, accDif = 0, accNrm = 0;
@@ -90,5 +340,24 @@ int main(int argc, char ** argv) {
   real_t accRel = std::sqrt(accDif/accNrm);
   printf("%-20s : %8.5e s\n","Rel. L2 Error (pot)", potRel);
   printf("%-20s : %8.5e s\n","Rel. L2 Error (acc)", accRel);
+  printf("%-20s : %8.5e s\n","M2L rotation (L)", std::sqrt(M2LDif/M2LNrm));
+  printf("%-20s : %8.5e s\n","Generic M2L (L)", std::sqrt(genericDif/genericNrm));
+  printf("%-20s : %8.5e s\n","Harmonics (Ynm)", std::sqrt(YDif/YNrm));
+  printf("%-20s : %8.5e s\n","Block P2M (M)", std::sqrt(MDif/MNrm));
+  printf("%-20s : %8.5e s\n","Block L2P (p, F)", std::sqrt(leafDif/leafNrm));
+  for (int newton=-1; newton<=3; newton++) {
+    char name[32];
+    snprintf(name, sizeof(name), "Rsqrt P2P %d (err)", newton);
+    printf("%-20s : %8.5e s\n", name, rsqrtErr[newton+1]);
+    snprintf(name, sizeof(name), "Rsqrt P2P %d (time)", newton);
+    printf("%-20s : %8.5e s\n", name, rsqrtTime[newton+1]);
+  }
+  printf("%-20s : %8.5e s\n","Mutual P2P (p, F)", std::sqrt(mutualDif/mutualNrm));
+  printf("%-20s : %8.5e s\n","Mutual M2L (L)", std::sqrt(mutualM2LDif/mutualM2LNrm));
+  printf("%-20s : %8.5e s\n","Float P2P (pot)", std::sqrt(potDifF/potNrmF));
+  printf("%-20s : %8.5e s\n","Float P2P (acc)", std::sqrt(accDifF/accNrmF));
+  assert(std::sqrt(genericDif/genericNrm) < 1e-12);
+  assert(std::sqrt(potDifF/potNrmF) < 1e-6);
+  assert(std::sqrt(accDifF/accNrmF) < 1e-5);
   return 0;
 }
@@ -1,22 +1,133 @@
 #ifndef kernel_h
 #define kernel_h
+#include <algorithm>
+#include <immintrin.h>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <stdint.h>
+#include <unordered_map>
+#include "timer.h"
 #include "types.h"
 
 namespace exafmm {
   const complex_t I(0.,1.);                                     //!< Imaginary unit
-  int P;                                                        //!< Order of expansions
-  int NTERM;                                                    //!< Number of coefficients
-  real_t dX[3];                                                 //!< Distance vector
-  real_t Xperiodic[3];                                          //!< Periodic coordinate offset
-  std::vector<real_t> prefactor;                                //!< sqrt( (n - |m|)! / (n + |m|)! )
-  std::vector<real_t> Anm;                                      //!< (-1)^n / sqrt( (n + m)! / (n - m)! )
-  std::vector<complex_t> Cnm;                                   //!< M2L translation matrix Cjknm
+  const int PMAX = 40;                                          //!< Largest order of the generic kernels, Anm overflows beyond
+  const int RHSMAX = 8;                                         //!< Largest number of right-hand sides
+#ifndef EXAFMM_RSQRT_NEWTON
+#define EXAFMM_RSQRT_NEWTON -1
+#endif
+
+  /**
+   * @brief Parameters, tables, and caches of one FMM engine
+   *
+   * @details The kernels, the tree, and the traversal take the context as their
+   * first argument and keep no state of their own, so two engines with
+   * different contexts can run at the same time. initKernel() computes the
+   * tables for P and NRHS.
+   */
+  struct Context {
+    int P = 0;                                                  //!< Order of expansions
+    int NTERM = 0;                                              //!< Number of coefficients
+    int NRHS = 1;                                               //!< Number of right-hand sides, the first is q, p, F of Body
+    std::vector<real_t> Qrhs;                                   //!< Charges of right-hand side r > 0 at IBODY*(NRHS-1)+r-1
+    std::vector<real_t> Prhs;                                   //!< Potentials of right-hand side r > 0, same layout
+    std::vector<real_t> Frhs;                                   //!< Forces of right-hand side r > 0, 3 per potential
+    int ncrit = 0;                                              //!< Number of bodies per leaf cell
+    real_t theta = 0;                                           //!< Multipole acceptance criterion
+    real_t cycle = 0;                                           //!< Period of the periodic box centered at the origin, 0 for free space
+    int images = 0;                                             //!< Number of periodic image sublevels
+    real_t Xperiodic[3] = {0, 0, 0};                            //!< Periodic coordinate offset (read-only during traversal)
+    int nspawn = 0;                                             //!< Threshold of NBODY for spawning new OpenMP tasks
+    bool batchM2L = false;                                      //!< Evaluate M2L lists with M2Lbatch
+    bool mutual = false;                                        //!< Evaluate each pair of a self interaction once, for both cells
+    bool rotateM2L = false;                                     //!< Use rotation-based O(p^3) M2L
+    int rsqrtNewton = EXAFMM_RSQRT_NEWTON;                      //!< Newton steps after the rsqrt estimate in P2P, -1 for exact
+    std::vector<real_t> prefactor;                              //!< sqrt( (n - |m|)! / (n + |m|)! )
+    std::vector<real_t> Anm;                                    //!< (-1)^n / sqrt( (n + m)! / (n - m)! )
+    std::vector<complex_t> Cnm;                                 //!< M2L translation matrix Cjknm
+    std::vector<complex_t> Dnm;                                 //!< Rotation of harmonics by -pi/2 about x, per degree
+    std::vector<complex_t> DnmInv;                              //!< Rotation of harmonics by +pi/2 about x, per degree
+    std::vector<complex_t> M2Mcache;                            //!< M2M harmonics for the 8 unit child offsets
+    std::vector<complex_t> L2Lcache;                            //!< L2L harmonics for the 8 unit child offsets
+    std::unordered_map<uint64_t, std::vector<complex_t> > M2Lcache;//!< M2L harmonics at integer offsets
+    std::shared_mutex M2Lmutex;                                 //!< Guards insertion into M2Lcache
+    std::mutex M2Llocks[256];                                   //!< Striped locks of M2Lbatch for scattering into targets
+    std::vector<Counter> counters;                              //!< Kernel counters of each thread, kernel, and level
+    std::vector<AlignedVector> scratch;                         //!< Source accumulators of P2Pmutual, one per thread
+  };
+
+  //! Charge of body B for right-hand side r
+  inline real_t charge(const Context & ctx, const Body & B, int r) {
+    return r ? ctx.Qrhs[B.IBODY*(ctx.NRHS-1)+r-1] : B.q;
+  }
+
+  //! Charge of body B for right-hand side r, writable
+  inline real_t & charge(Context & ctx, Body & B, int r) {
+    return r ? ctx.Qrhs[B.IBODY*(ctx.NRHS-1)+r-1] : B.q;
+  }
+
+  //! Potential of body B for right-hand side r
+  inline real_t & potential(Context & ctx, Body & B, int r) {
+    return r ? ctx.Prhs[B.IBODY*(ctx.NRHS-1)+r-1] : B.p;
+  }
+
+  //! Force of body B for right-hand side r
+  inline real_t * force(Context & ctx, Body & B, int r) {
+    return r ? &ctx.Frhs[3*(B.IBODY*(ctx.NRHS-1)+r-1)] : B.F;
+  }
 
   //! Odd or even
   inline int oddOrEven(int n) {
     return (((n) & 1) == 1) ? -1 : 1;
   }
 
+  /**
+   * @brief Call the kernel specialized for the runtime order P
+   *
+   * @details Kernels are templates on the order PT, so loop bounds and scratch
+   * arrays are compile-time constants for the common orders listed here. Other
+   * orders use the generic kernel PT = 0, which reads P of the context and sizes its
+   * scratch arrays for PMAX.
+   */
+#define EXAFMM_DISPATCH(kernel, ctx, ...)                       \
+  switch ((ctx).P) {                                            \
+  case 4: kernel<4>(ctx, __VA_ARGS__); break;                   \
+  case 6: kernel<6>(ctx, __VA_ARGS__); break;                   \
+  case 8: kernel<8>(ctx, __VA_ARGS__); break;                   \
+  case 10: kernel<10>(ctx, __VA_ARGS__); break;                 \
+  case 12: kernel<12>(ctx, __VA_ARGS__); break;                 \
+  case 16: kernel<16>(ctx, __VA_ARGS__); break;                 \
+  case 20: kernel<20>(ctx, __VA_ARGS__); break;                 \
+  default: kernel<0>(ctx, __VA_ARGS__);                         \
+  }
+
+  /**
+   * @brief Call the kernel specialized for P and for one or several right-hand sides
+   *
+   * @details Kernels that carry NRHS expansions are templates on the order PT and
+   * the number of right-hand sides NR, where NR = 0 reads NRHS at runtime. The
+   * single right-hand side keeps its loops free of the extra dimension.
+   */
+#define EXAFMM_DISPATCH_NR(kernel, NR, ctx, ...)                \
+  switch ((ctx).P) {                                            \
+  case 4: kernel<4, NR>(ctx, __VA_ARGS__); break;               \
+  case 6: kernel<6, NR>(ctx, __VA_ARGS__); break;               \
+  case 8: kernel<8, NR>(ctx, __VA_ARGS__); break;               \
+  case 10: kernel<10, NR>(ctx, __VA_ARGS__); break;             \
+  case 12: kernel<12, NR>(ctx, __VA_ARGS__); break;             \
+  case 16: kernel<16, NR>(ctx, __VA_ARGS__); break;             \
+  case 20: kernel<20, NR>(ctx, __VA_ARGS__); break;             \
+  default: kernel<0, NR>(ctx, __VA_ARGS__);                     \
+  }
+
+#define EXAFMM_DISPATCH_RHS(kernel, ctx, ...)                   \
+  if ((ctx).NRHS == 1) {                                        \
+    EXAFMM_DISPATCH_NR(kernel, 1, ctx, __VA_ARGS__);            \
+  } else {                                                      \
+    EXAFMM_DISPATCH_NR(kernel, 0, ctx, __VA_ARGS__);            \
+  }
+
   //! Get r,theta,phi from x,y,z
   void cart2sph(real_t * dX, real_t & r, real_t & theta, real_t & phi) {
     r = sqrt(dX[0] * dX[0] + dX[1] * dX[1] + dX[2] * dX[2]);    // r = sqrt(x^2 + y^2 + z^2)
@@ -37,80 +148,191 @@ namespace exafmm {
   }
 
   //! Evaluate solid harmonics \f$ r^n Y_{n}^{m} \f$
-  void evalMultipole(real_t rho, real_t alpha, real_t beta, complex_t * Ynm, complex_t * YnmTheta) {
+  template<int PT>
+  void evalMultipole(Context & ctx, real_t rho, real_t alpha, real_t beta, complex_t * Ynm, complex_t * YnmTheta) {
+    const int P = PT ? PT : ctx.P;                              // Order of expansions
     real_t x = std::cos(alpha);                                 // x = cos(alpha)
     real_t y = std::sin(alpha);                                 // y = sin(alpha)
     real_t fact = 1;                                            // Initialize 2 * m + 1
     real_t pn = 1;                                              // Initialize Legendre polynomial Pn
+    real_t invY = 1 / y;                                        // 1 / sin(alpha), hoisted out of the loops
     real_t rhom = 1;                                            // Initialize rho^m
+    complex_t eib = std::exp(I * beta);                         // exp(i * beta)
+    complex_t eim = 1;                                          // Initialize exp(i * m * beta)
     for (int m=0; m<P; m++) {                                   // Loop over m in Ynm
-      complex_t eim = std::exp(I * real_t(m * beta));           //  exp(i * m * beta)
       real_t p = pn;                                            //  Associated Legendre polynomial Pnm
       int npn = m * m + 2 * m;                                  //  Index of Ynm for m > 0
       int nmn = m * m;                                          //  Index of Ynm for m < 0
-      Ynm[npn] = rhom * p * prefactor[npn] * eim;               //  rho^m * Ynm for m > 0
+      Ynm[npn] = rhom * p * ctx.prefactor[npn] * eim;           //  rho^m * Ynm for m > 0
       Ynm[nmn] = std::conj(Ynm[npn]);                           //  Use conjugate relation for m < 0
       real_t p1 = p;                                            //  Pnm-1
       p = x * (2 * m + 1) * p1;                                 //  Pnm using recurrence relation
-      YnmTheta[npn] = rhom * (p - (m + 1) * x * p1) / y * prefactor[npn] * eim;// theta derivative of r^n * Ynm
+      YnmTheta[npn] = rhom * (p - (m + 1) * x * p1) * invY * ctx.prefactor[npn] * eim;// theta derivative of r^n * Ynm
       rhom *= rho;                                              //  rho^m
       real_t rhon = rhom;                                       //  rho^n
       for (int n=m+1; n<P; n++) {                               //  Loop over n in Ynm
         int npm = n * n + n + m;                                //   Index of Ynm for m > 0
         int nmm = n * n + n - m;                                //   Index of Ynm for m < 0
-        Ynm[npm] = rhon * p * prefactor[npm] * eim;             //   rho^n * Ynm
+        Ynm[npm] = rhon * p * ctx.prefactor[npm] * eim;         //   rho^n * Ynm
         Ynm[nmm] = std::conj(Ynm[npm]);                         //   Use conjugate relation for m < 0
         real_t p2 = p1;                                         //   Pnm-2
         p1 = p;                                                 //   Pnm-1
         p = (x * (2 * n + 1) * p1 - (n + m) * p2) / (n - m + 1);//   Pnm using recurrence relation
-        YnmTheta[npm] = rhon * ((n - m + 1) * p - (n + 1) * x * p1) / y * prefactor[npm] * eim;// theta derivative
+        YnmTheta[npm] = rhon * ((n - m + 1) * p - (n + 1) * x * p1) * invY * ctx.prefactor[npm] * eim;// theta derivative
         rhon *= rho;                                            //   Update rho^n
       }                                                         //  End loop over n in Ynm
       pn = -pn * fact * y;                                      //  Pn
       fact += 2;                                                //  2 * m + 1
+      eim *= eib;                                               //  exp(i * m * beta) by recurrence
     }                                                           // End loop over m in Ynm
   }
 
+  //! Evaluate solid harmonics at the runtime order P
+  void evalMultipole(Context & ctx, real_t rho, real_t alpha, real_t beta, complex_t * Ynm, complex_t * YnmTheta) {
+    evalMultipole<0>(ctx, rho, alpha, beta, Ynm, YnmTheta);
+  }
+
   //! Evaluate singular harmonics \f$ r^{-n-1} Y_n^m \f$
-  void evalLocal(real_t rho, real_t alpha, real_t beta, complex_t * Ynm2) {
+  template<int PT>
+  void evalLocal(Context & ctx, real_t rho, real_t alpha, real_t beta, complex_t * Ynm2) {
+    const int P = PT ? PT : ctx.P;                              // Order of expansions
     real_t x = std::cos(alpha);                                 // x = cos(alpha)
     real_t y = std::sin(alpha);                                 // y = sin(alpha)
     real_t fact = 1;                                            // Initialize 2 * m + 1
     real_t pn = 1;                                              // Initialize Legendre polynomial Pn
-    real_t rhom = 1.0 / rho;                                    // Initialize rho^(-m-1)
+    real_t invRho = 1 / rho;                                    // 1 / rho
+    real_t rhom = invRho;                                       // Initialize rho^(-m-1)
+    complex_t eib = std::exp(I * beta);                         // exp(i * beta)
+    complex_t eim = 1;                                          // Initialize exp(i * m * beta)
     for (int m=0; m<2*P; m++) {                                 // Loop over m in Ynm
-      complex_t eim = std::exp(I * real_t(m * beta));           //  exp(i * m * beta)
       real_t p = pn;                                            //  Associated Legendre polynomial Pnm
       int npn = m * m + 2 * m;                                  //  Index of Ynm for m > 0
       int nmn = m * m;                                          //  Index of Ynm for m < 0
-      Ynm2[npn] = rhom * p * prefactor[npn] * eim;              //  rho^(-m-1) * Ynm for m > 0
+      Ynm2[npn] = rhom * p * ctx.prefactor[npn] * eim;          //  rho^(-m-1) * Ynm for m > 0
       Ynm2[nmn] = std::conj(Ynm2[npn]);                         //  Use conjugate relation for m < 0
       real_t p1 = p;                                            //  Pnm-1
       p = x * (2 * m + 1) * p1;                                 //  Pnm using recurrence relation
-      rhom /= rho;                                              //  rho^(-m-1)
+      rhom *= invRho;                                           //  rho^(-m-1)
       real_t rhon = rhom;                                       //  rho^(-n-1)
       for (int n=m+1; n<2*P; n++) {                             //  Loop over n in Ynm
         int npm = n * n + n + m;                                //   Index of Ynm for m > 0
         int nmm = n * n + n - m;                                //   Index of Ynm for m < 0
-        Ynm2[npm] = rhon * p * prefactor[npm] * eim;            //   rho^n * Ynm for m > 0
+        Ynm2[npm] = rhon * p * ctx.prefactor[npm] * eim;        //   rho^n * Ynm for m > 0
         Ynm2[nmm] = std::conj(Ynm2[npm]);                       //   Use conjugate relation for m < 0
         real_t p2 = p1;                                         //   Pnm-2
         p1 = p;                                                 //   Pnm-1
         p = (x * (2 * n + 1) * p1 - (n + m) * p2) / (n - m + 1);//   Pnm using recurrence relation
-        rhon /= rho;                                            //   rho^(-n-1)
+        rhon *= invRho;                                         //   rho^(-n-1)
       }                                                         //  End loop over n in Ynm
       pn = -pn * fact * y;                                      //  Pn
       fact += 2;                                                //  2 * m + 1
+      eim *= eib;                                               //  exp(i * m * beta) by recurrence
     }                                                           // End loop over m in Ynm
   }
 
-  void initKernel() {
-    NTERM = P * (P + 1) / 2;                                    // Calculate number of coefficients
-    for (int d=0; d<3; d++) Xperiodic[d] = 0;                   // Initialize periodic coordinate shift
-    prefactor.resize(4*P*P);                                    // Resize prefactor
-    Anm.resize(4*P*P);                                          // Resize Anm
-    Cnm.resize(P*P*P*P);                                        // Resize Cnm
-    for (int n=0; n<2*P; n++) {                                 // Loop over n in Anm
+  //! Evaluate singular harmonics at the runtime order P
+  void evalLocal(Context & ctx, real_t rho, real_t alpha, real_t beta, complex_t * Ynm2) {
+    evalLocal<0>(ctx, rho, alpha, beta, Ynm2);
+  }
+
+  /**
+   * @brief Matrices of a fixed rotation in the basis of surface harmonics
+   *
+   * @details Computes T such that \f$ Y_n^m(S \hat{x}) = \sum_a T_{ma} Y_n^a(\hat{x}) \f$
+   * for each degree n < P, by Gauss-Legendre quadrature in cos(theta) and the
+   * trapezoidal rule in phi. Both are exact for products of degree n harmonics,
+   * and using evalMultipole directly keeps the matrices consistent with the
+   * normalization of the expansions.
+   *
+   * @param S Rotation matrix
+   * @param T Block of (2n+1)x(2n+1) matrices for n = 0..P-1
+   */
+  void rotationMatrix(Context & ctx, real_t S[3][3], std::vector<complex_t> & T) {
+    int ntheta = ctx.P, nphi = 2 * ctx.P;                       // Number of quadrature points
+    std::vector<real_t> xq(ntheta), wq(ntheta);                 // Gauss-Legendre nodes and weights
+    for (int i=0; i<ntheta; i++) {                              // Loop over nodes
+      real_t z = std::cos(M_PI * (i + 0.75) / (ntheta + 0.5));  //  Initial guess
+      real_t dp = 1;                                            //  Derivative of Legendre polynomial
+      for (int iter=0; iter<100; iter++) {                      //  Newton iterations
+        real_t p1 = 1, p2 = 0;                                  //   Legendre polynomials P_j, P_j-1
+        for (int j=1; j<=ntheta; j++) {                         //   Loop over degree
+          real_t p3 = p2;                                       //    P_j-2
+          p2 = p1;                                              //    P_j-1
+          p1 = ((2 * j - 1) * z * p2 - (j - 1) * p3) / j;       //    P_j by recurrence
+        }                                                       //   End loop over degree
+        dp = ntheta * (z * p1 - p2) / (z * z - 1);              //   Derivative of P_n
+        real_t dz = p1 / dp;                                    //   Newton step
+        z -= dz;                                                //   Update node
+        if (std::abs(dz) < 1e-15) break;                        //   Converged
+      }                                                         //  End Newton iterations
+      xq[i] = z;                                                //  Node
+      wq[i] = 2 / ((1 - z * z) * dp * dp);                      //  Weight
+    }                                                           // End loop over nodes
+    T.assign((4*ctx.P*ctx.P*ctx.P - ctx.P) / 3, 0);             // Sum of (2n+1)^2 for n < P
+    std::vector<complex_t> Ynm(ctx.P*ctx.P), YnmS(ctx.P*ctx.P), YnmTheta(ctx.P*ctx.P);// Harmonics at original and rotated points
+    for (int i=0; i<ntheta; i++) {                              // Loop over theta
+      for (int k=0; k<nphi; k++) {                              //  Loop over phi
+        real_t phi = 2 * M_PI * k / nphi;                       //   Azimuth
+        real_t X[3], SX[3];                                     //   Point on unit sphere and its rotation
+        real_t sint = std::sqrt(1 - xq[i] * xq[i]);             //   sin(theta)
+        X[0] = sint * std::cos(phi);                            //   x
+        X[1] = sint * std::sin(phi);                            //   y
+        X[2] = xq[i];                                           //   z
+        for (int d=0; d<3; d++) {                               //   Loop over dimensions
+          SX[d] = S[d][0] * X[0] + S[d][1] * X[1] + S[d][2] * X[2];//  Rotated point
+        }                                                       //   End loop over dimensions
+        real_t r, theta, beta;                                  //   Spherical coordinates
+        cart2sph(X, r, theta, beta);                            //   Original point
+        evalMultipole(ctx, 1, theta, beta, &Ynm[0], &YnmTheta[0]);//   Harmonics at original point
+        cart2sph(SX, r, theta, beta);                           //   Rotated point
+        evalMultipole(ctx, 1, theta, beta, &YnmS[0], &YnmTheta[0]);//   Harmonics at rotated point
+        real_t w = wq[i] * 2 * M_PI / nphi / (4 * M_PI);        //   Quadrature weight over 4 pi
+        for (int n=0, offset=0; n<ctx.P; offset+=(2*n+1)*(2*n+1), n++) {// Loop over degree
+          for (int m=-n; m<=n; m++) {                           //    Loop over rows
+            for (int a=-n; a<=n; a++) {                         //     Loop over columns
+              T[offset+(n+m)*(2*n+1)+n+a] += real_t((2 * n + 1) * w)// Projection onto Y_n^a
+                * YnmS[n*n+n+m] * std::conj(Ynm[n*n+n+a]);
+            }                                                   //     End loop over columns
+          }                                                     //    End loop over rows
+        }                                                       //   End loop over degree
+      }                                                         //  End loop over phi
+    }                                                           // End loop over theta
+  }
+
+  //! Number of bodies rounded up to a multiple of the SIMD width
+  inline int paddedSize(int n) {
+    return (n + NSIMD - 1) / NSIMD * NSIMD;
+  }
+
+  /**
+   * @brief Size the per-thread scratch of P2Pmutual for the threads of the next parallel region
+   *
+   * @details A leaf holds at most 2 * ncrit bodies after updateTree(), so the
+   * buffers are allocated once for that size. Only a leaf at maxLevel can be
+   * larger, and P2Pmutual then grows the buffer of its own thread.
+   *
+   * @param ctx Context with ncrit
+   */
+  void reserveScratch(Context & ctx) {
+    int nthreads = omp_get_max_threads();                       // Threads of the next parallel region
+    size_t n = 4 * paddedSize(2 * ctx.ncrit);                   // p, Fx, Fy, Fz of the largest leaf
+    if (int(ctx.scratch.size()) < nthreads) ctx.scratch.resize(nthreads);// One buffer per thread
+    for (size_t t=0; t<ctx.scratch.size(); t++) {               // Loop over threads
+      if (ctx.scratch[t].size() < n) ctx.scratch[t].resize(n);  //  Grow buffer of thread
+    }                                                           // End loop over threads
+  }
+
+  void initKernel(Context & ctx) {
+    if (ctx.P < 1 || ctx.P > PMAX) throw std::out_of_range("P must be in [1, PMAX]");// Check order of expansions
+    if (ctx.NRHS < 1 || ctx.NRHS > RHSMAX) throw std::out_of_range("NRHS must be in [1, RHSMAX]");// Check right-hand sides
+    ctx.NTERM = ctx.P * (ctx.P + 1) / 2;                        // Calculate number of coefficients
+    for (int d=0; d<3; d++) ctx.Xperiodic[d] = 0;               // Initialize periodic coordinate shift
+    resetProfile(ctx.counters);                                 // Clear kernel counters
+    reserveScratch(ctx);                                        // Scratch of P2Pmutual
+    ctx.prefactor.resize(4*ctx.P*ctx.P);                        // Resize prefactor
+    ctx.Anm.resize(4*ctx.P*ctx.P);                              // Resize Anm
+    ctx.Cnm.resize(ctx.P*ctx.P*ctx.P*ctx.P);                    // Resize Cnm
+    for (int n=0; n<2*ctx.P; n++) {                             // Loop over n in Anm
       for (int m=-n; m<=n; m++) {                               //  Loop over m in Anm
         int nm = n*n+n+m;                                       //   Index of Anm
         int nabsm = abs(m);                                     //   |m|
@@ -122,90 +344,526 @@ namespace exafmm {
         for (int i=1; i<=n-nabsm; i++) fnma *= i;               //   (n - |m|)!
         real_t fnpa = 1.0;                                      //   Initialize (n + |m|)!
         for (int i=1; i<=n+nabsm; i++) fnpa *= i;               //   (n + |m|)!
-        prefactor[nm] = std::sqrt(fnma/fnpa);                   //   sqrt( (n - |m|)! / (n + |m|)! )
-        Anm[nm] = oddOrEven(n)/std::sqrt(fnmm*fnpm);            //   (-1)^n / sqrt( (n + m)! / (n - m)! )
+        ctx.prefactor[nm] = std::sqrt(fnma/fnpa);               //   sqrt( (n - |m|)! / (n + |m|)! )
+        ctx.Anm[nm] = oddOrEven(n)/std::sqrt(fnmm*fnpm);        //   (-1)^n / sqrt( (n + m)! / (n - m)! )
       }                                                         //  End loop over m in Anm
     }                                                           // End loop over n in Anm
-    for (int j=0, jk=0, jknm=0; j<P; j++) {                     // Loop over j in Cjknm
+    for (int j=0, jk=0, jknm=0; j<ctx.P; j++) {                 // Loop over j in Cjknm
       for (int k=-j; k<=j; k++, jk++) {                         //  Loop over k in Cjknm
-        for (int n=0, nm=0; n<P; n++) {                         //   Loop over n in Cjknm
+        for (int n=0, nm=0; n<ctx.P; n++) {                     //   Loop over n in Cjknm
           for (int m=-n; m<=n; m++, nm++, jknm++) {             //    Loop over m in Cjknm
             const int jnkm = (j+n)*(j+n)+j+n+m-k;               //     Index C_{j+n}^{m-k}
-            Cnm[jknm] = std::pow(I,real_t(abs(k-m)-abs(k)-abs(m)))//     Cjknm
-              * real_t(oddOrEven(j)*Anm[nm]*Anm[jk]/Anm[jnkm]);
+            ctx.Cnm[jknm] = std::pow(I,real_t(abs(k-m)-abs(k)-abs(m)))//     Cjknm
+              * real_t(oddOrEven(j)*ctx.Anm[nm]*ctx.Anm[jk]/ctx.Anm[jnkm]);
           }                                                     //    End loop over m in Cjknm
         }                                                       //   End loop over n in Cjknm
       }                                                         //  End loop over in k in Cjknm
     }                                                           // End loop over in j in Cjknm
+    real_t S[3][3] = {{1, 0, 0}, {0, 0, 1}, {0, -1, 0}};        // Rotation by -pi/2 about x, maps z to y
+    real_t Sinv[3][3] = {{1, 0, 0}, {0, 0, -1}, {0, 1, 0}};     // Rotation by +pi/2 about x, maps y to z
+    rotationMatrix(ctx, S, ctx.Dnm);                            // Harmonics rotated by S
+    rotationMatrix(ctx, Sinv, ctx.DnmInv);                      // Harmonics rotated by S^-1
+    ctx.M2Mcache.resize(8*ctx.P*ctx.P);                         // Resize M2M cache
+    ctx.L2Lcache.resize(8*ctx.P*ctx.P);                         // Resize L2L cache
+    std::vector<complex_t> YnmTheta(ctx.P*ctx.P);               // Theta derivative, not used
+    for (int i=0; i<8; i++) {                                   // Loop over child octants
+      real_t dX[3], rho, alpha, beta;                           //  Child to parent offset in units of child radius
+      for (int d=0; d<3; d++) dX[d] = ((i >> d) & 1) * 2 - 1;   //  Child center relative to parent
+      cart2sph(dX, rho, alpha, beta);                           //  Spherical coordinates
+      evalMultipole(ctx, rho, alpha, beta, &ctx.L2Lcache[i*ctx.P*ctx.P], &YnmTheta[0]);// L2L uses child - parent
+      for (int d=0; d<3; d++) dX[d] = -dX[d];                   //  Parent relative to child
+      cart2sph(dX, rho, alpha, beta);                           //  Spherical coordinates
+      evalMultipole(ctx, rho, alpha, -beta, &ctx.M2Mcache[i*ctx.P*ctx.P], &YnmTheta[0]);// M2M uses parent - child
+    }                                                           // End loop over child octants
+    ctx.M2Lcache.clear();                                       // Entries depend on P
   }
 
-  void P2P(Cell * Ci, Cell * Cj) {
+  //! Copy coordinates and charges of a cell into its SoA source block, one charge array per right-hand side
+  void packSources(Context & ctx, Cell * C) {
+    int npad = paddedSize(C->NBODY);                            // Length of each of the x, y, z, q arrays
+    C->SRC.assign((3 + ctx.NRHS) * npad, 0);                    // Padding has zero charge
+    p2p_t * x = C->SRC.data();                                  // x coordinates
+    p2p_t * y = x + npad;                                       // y coordinates
+    p2p_t * z = y + npad;                                       // z coordinates
+    p2p_t * q = z + npad;                                       // Charges
+    for (int b=0; b<C->NBODY; b++) {                            // Loop over bodies
+      x[b] = C->BODY[b].X[0];                                   //  Copy x coordinate
+      y[b] = C->BODY[b].X[1];                                   //  Copy y coordinate
+      z[b] = C->BODY[b].X[2];                                   //  Copy z coordinate
+      for (int r=0; r<ctx.NRHS; r++) q[r*npad+b] = charge(ctx, C->BODY[b], r);// Copy charges
+    }                                                           // End loop over bodies
+  }
+
+  /**
+   * @brief Vectorized P2P for a single target against a SoA block of sources
+   *
+   * @details The self interaction is removed with a mask instead of a branch,
+   * so the loop compiles to straight-line SIMD code for float and double. The
+   * sum over the block is in T, and it is added to accumulators of type A.
+   *
+   * @param X Target position
+   * @param x,y,z,q Aligned source coordinates and charges
+   * @param nj Number of sources, a multiple of the SIMD width
+   * @param pot Accumulated potential
+   * @param F Accumulated force
+   */
+  template<typename T, typename A>
+  void P2P(const T * X, const T * __restrict__ x, const T * __restrict__ y,
+           const T * __restrict__ z, const T * __restrict__ q, int nj, A & pot, A * F) {
+    T p = 0, ax = 0, ay = 0, az = 0;
+#pragma omp simd aligned(x, y, z, q : SIMD_BYTES) reduction(+:p, ax, ay, az)
+    for (int j=0; j<nj; j++) {
+      T dx = X[0] - x[j];
+      T dy = X[1] - y[j];
+      T dz = X[2] - z[j];
+      T R2 = dx * dx + dy * dy + dz * dz;
+      T invR2 = R2 > 0 ? T(1) / R2 : T(0);
+      T invR = q[j] * std::sqrt(invR2);
+      T invR3 = invR2 * invR;
+      p += invR;
+      ax += dx * invR3;
+      ay += dy * invR3;
+      az += dz * invR3;
+    }
+    pot += p;
+    F[0] -= ax;
+    F[1] -= ay;
+    F[2] -= az;
+  }
+
+#if defined(__AVX512F__)
+  typedef __m512d simd_d;                                       //!< SIMD vector of double
+  typedef __m512 simd_f;                                        //!< SIMD vector of float
+  inline simd_d load(const double * p) { return _mm512_load_pd(p); }
+  inline simd_f load(const float * p) { return _mm512_load_ps(p); }
+  inline void set1(simd_d & v, double a) { v = _mm512_set1_pd(a); }
+  inline void set1(simd_f & v, float a) { v = _mm512_set1_ps(a); }
+  inline double reduce(simd_d v) { double a[8], s = 0; _mm512_storeu_pd(a, v); for (int i=0; i<8; i++) s += a[i]; return s; }
+  inline float reduce(simd_f v) { float a[16], s = 0; _mm512_storeu_ps(a, v); for (int i=0; i<16; i++) s += a[i]; return s; }
+  inline simd_d rsqrt(simd_d R2) { return _mm512_maskz_rsqrt14_pd(_mm512_cmp_pd_mask(R2, _mm512_setzero_pd(), _CMP_GT_OQ), R2); }
+  inline simd_f rsqrt(simd_f R2) { return _mm512_maskz_rsqrt14_ps(_mm512_cmp_ps_mask(R2, _mm512_setzero_ps(), _CMP_GT_OQ), R2); }
+#elif defined(__AVX__)
+  typedef __m256d simd_d;                                       //!< SIMD vector of double
+  typedef __m256 simd_f;                                        //!< SIMD vector of float
+  inline simd_d load(const double * p) { return _mm256_load_pd(p); }
+  inline simd_f load(const float * p) { return _mm256_load_ps(p); }
+  inline void set1(simd_d & v, double a) { v = _mm256_set1_pd(a); }
+  inline void set1(simd_f & v, float a) { v = _mm256_set1_ps(a); }
+  inline double reduce(simd_d v) { double a[4]; _mm256_storeu_pd(a, v); return a[0] + a[1] + a[2] + a[3]; }
+  inline float reduce(simd_f v) { float a[8]; _mm256_storeu_ps(a, v); return a[0] + a[1] + a[2] + a[3] + a[4] + a[5] + a[6] + a[7]; }
+  inline simd_d rsqrt(simd_d R2) {
+    return _mm256_and_pd(_mm256_cmp_pd(R2, _mm256_setzero_pd(), _CMP_GT_OQ), _mm256_cvtps_pd(_mm_rsqrt_ps(_mm256_cvtpd_ps(R2))));
+  }
+  inline simd_f rsqrt(simd_f R2) { return _mm256_and_ps(_mm256_cmp_ps(R2, _mm256_setzero_ps(), _CMP_GT_OQ), _mm256_rsqrt_ps(R2)); }
+#endif
+
+#if defined(__AVX__)
+  template<typename T> struct SIMD;                             //!< SIMD vector of T
+  template<> struct SIMD<double> { typedef simd_d type; };
+  template<> struct SIMD<float> { typedef simd_f type; };
+
+  /**
+   * @brief P2P with the hardware reciprocal square root estimate
+   *
+   * @details rsqrt14 on AVX-512 gives 14 bits and rsqrtps on AVX gives 12 bits.
+   * Each Newton step roughly doubles that, so one step is enough for float and
+   * two for double. The estimate is zero where R2 is zero, which removes the self
+   * interaction.
+   *
+   * @tparam NEWTON Number of Newton steps
+   */
+  template<int NEWTON, typename T, typename A>
+  void P2Prsqrt(const T * X, const T * x, const T * y, const T * z, const T * q, int nj, A & pot, A * F) {
+    typedef typename SIMD<T>::type V;
+    const int W = sizeof(V) / sizeof(T);
+    V xi, yi, zi, half, threeHalves, p, ax, ay, az;
+    set1(xi, X[0]);
+    set1(yi, X[1]);
+    set1(zi, X[2]);
+    set1(half, .5);
+    set1(threeHalves, 1.5);
+    set1(p, 0);
+    ax = ay = az = p;
+    for (int j=0; j<nj; j+=W) {
+      V dx = xi - load(x + j);
+      V dy = yi - load(y + j);
+      V dz = zi - load(z + j);
+      V R2 = dx * dx + dy * dy + dz * dz;
+      V invR = rsqrt(R2);
+      for (int n=0; n<NEWTON; n++) invR = invR * (threeHalves - half * R2 * invR * invR);
+      V invR2 = invR * invR;
+      invR *= load(q + j);
+      V invR3 = invR2 * invR;
+      p += invR;
+      ax += dx * invR3;
+      ay += dy * invR3;
+      az += dz * invR3;
+    }
+    pot += reduce(p);
+    F[0] -= reduce(ax);
+    F[1] -= reduce(ay);
+    F[2] -= reduce(az);
+  }
+#else
+  template<int NEWTON, typename T, typename A>
+  void P2Prsqrt(const T * X, const T * x, const T * y, const T * z, const T * q, int nj, A & pot, A * F) {
+    P2P(X, x, y, z, q, nj, pot, F);
+  }
+#endif
+
+  /**
+   * @brief P2P for a single target and several right-hand sides
+   *
+   * @details The kernel 1/R and its gradient are evaluated once for a block of
+   * sources, and each right-hand side is then a dot product of its charges with
+   * them. The exact kernel is used for any rsqrtNewton.
+   *
+   * @param X Target position
+   * @param x,y,z Aligned source coordinates
+   * @param q Aligned charges, NRHS arrays of length nj
+   * @param nj Number of sources, a multiple of the SIMD width
+   * @param NRHS Number of right-hand sides
+   * @param pot Accumulated potential of each right-hand side
+   * @param F Accumulated force of each right-hand side
+   */
+  template<typename T>
+  void P2Prhs(const T * X, const T * __restrict__ x, const T * __restrict__ y,
+              const T * __restrict__ z, const T * __restrict__ q, int nj, int NRHS, real_t * pot, real_t * F) {
+    const int NJ = 64;
+    alignas(SIMD_BYTES) T w[NJ], wx[NJ], wy[NJ], wz[NJ];
+    for (int j0=0; j0<nj; j0+=NJ) {
+      int nb = std::min(NJ, nj - j0);
+#pragma omp simd aligned(w, wx, wy, wz : SIMD_BYTES)
+      for (int j=0; j<nb; j++) {
+        T dx = X[0] - x[j0+j];
+        T dy = X[1] - y[j0+j];
+        T dz = X[2] - z[j0+j];
+        T R2 = dx * dx + dy * dy + dz * dz;
+        T invR2 = R2 > 0 ? T(1) / R2 : T(0);
+        T invR = std::sqrt(invR2);
+        T invR3 = invR2 * invR;
+        w[j] = invR;
+        wx[j] = dx * invR3;
+        wy[j] = dy * invR3;
+        wz[j] = dz * invR3;
+      }
+      for (int r=0; r<NRHS; r++) {
+        const T * qr = q + r * nj + j0;
+        T p = 0, ax = 0, ay = 0, az = 0;
+#pragma omp simd aligned(w, wx, wy, wz : SIMD_BYTES) reduction(+:p, ax, ay, az)
+        for (int j=0; j<nb; j++) {
+          p += qr[j] * w[j];
+          ax += qr[j] * wx[j];
+          ay += qr[j] * wy[j];
+          az += qr[j] * wz[j];
+        }
+        pot[r] += p;
+        F[3*r+0] -= ax;
+        F[3*r+1] -= ay;
+        F[3*r+2] -= az;
+      }
+    }
+  }
+
+  void P2P(Context & ctx, Cell * Ci, Cell * Cj) {
+    EXAFMM_PROFILE_BEGIN;
     Body * Bi = Ci->BODY;
-    Body * Bj = Cj->BODY;
     int ni = Ci->NBODY;
-    int nj = Cj->NBODY;
+    int npad = paddedSize(Cj->NBODY);
+    const p2p_t * xj = Cj->SRC.data();
+    const p2p_t * yj = xj + npad;
+    const p2p_t * zj = yj + npad;
+    const p2p_t * qj = zj + npad;
     for (int i=0; i<ni; i++) {
-      real_t pot = 0;
-      real_t ax = 0;
-      real_t ay = 0;
-      real_t az = 0;
-      for (int j=0; j<nj; j++) {
-        for (int d=0; d<3; d++) dX[d] = Bi[i].X[d] - Bj[j].X[d] - Xperiodic[d];
-        real_t R2 = dX[0] * dX[0] + dX[1] * dX[1] + dX[2] * dX[2];
-        if (R2 != 0) {
-          real_t invR2 = 1.0 / R2;
-          real_t invR = Bj[j].q * sqrt(invR2);
-          for (int d=0; d<3; d++) dX[d] *= invR2 * invR;
-          pot += invR;
-          ax += dX[0];
-          ay += dX[1];
-          az += dX[2];
+      p2p_t X[3];
+      for (int d=0; d<3; d++) X[d] = Bi[i].X[d] - ctx.Xperiodic[d];
+      if (ctx.NRHS > 1) {
+        real_t pot[RHSMAX] = {0}, F[3*RHSMAX] = {0};
+        P2Prhs(X, xj, yj, zj, qj, npad, ctx.NRHS, pot, F);
+        for (int r=0; r<ctx.NRHS; r++) {
+          potential(ctx, Bi[i], r) += pot[r];
+          for (int d=0; d<3; d++) force(ctx, Bi[i], r)[d] += F[3*r+d];
         }
+        continue;
+      }
+      switch (ctx.rsqrtNewton) {
+      case 0: P2Prsqrt<0>(X, xj, yj, zj, qj, npad, Bi[i].p, Bi[i].F); break;
+      case 1: P2Prsqrt<1>(X, xj, yj, zj, qj, npad, Bi[i].p, Bi[i].F); break;
+      case 2: P2Prsqrt<2>(X, xj, yj, zj, qj, npad, Bi[i].p, Bi[i].F); break;
+      case 3: P2Prsqrt<3>(X, xj, yj, zj, qj, npad, Bi[i].p, Bi[i].F); break;
+      default: P2P(X, xj, yj, zj, qj, npad, Bi[i].p, Bi[i].F);
       }
-      Bi[i].p += pot;
-      Bi[i].F[0] -= ax;
-      Bi[i].F[1] -= ay;
-      Bi[i].F[2] -= az;
     }
+    EXAFMM_PROFILE_END(ctx, kernelP2P, Ci->LEVEL, uint64_t(ni) * Cj->NBODY, uint64_t(ni) * Cj->NBODY * (12 + 8 * ctx.NRHS));
   }
 
-  void P2M(Cell * C) {
-    complex_t Ynm[P*P], YnmTheta[P*P];
-    for (Body * B=C->BODY; B!=C->BODY+C->NBODY; B++) {
-      for (int d=0; d<3; d++) dX[d] = B->X[d] - C->X[d];
-      real_t rho, alpha, beta;
-      cart2sph(dX, rho, alpha, beta);
-      evalMultipole(rho, alpha, -beta, Ynm, YnmTheta);
-      for (int n=0; n<P; n++) {
-        for (int m=0; m<=n; m++) {
-          int nm  = n * n + n + m;
-          int nms = n * (n + 1) / 2 + m;
-          C->M[nms] += B->q * Ynm[nm];
+  /**
+   * @brief P2P of a single target with a SoA block of sources, in both directions
+   *
+   * @details Each 1/R is used for the target and, with the opposite sign of the
+   * force, for the source, so a pair of bodies is evaluated once. The sources
+   * are written to their own accumulators, which keeps the loop free of
+   * dependences between iterations.
+   *
+   * @param X Target position
+   * @param qi Target charge
+   * @param x,y,z,q Aligned source coordinates and charges
+   * @param nj Number of sources, a multiple of the SIMD width
+   * @param pot Accumulated potential of the target
+   * @param F Accumulated force of the target
+   * @param pj,fx,fy,fz Aligned accumulated potential and force of the sources
+   */
+  template<typename T>
+  void P2Pmutual(const T * X, T qi, const T * __restrict__ x, const T * __restrict__ y,
+                 const T * __restrict__ z, const T * __restrict__ q, int nj, real_t & pot, real_t * F,
+                 T * __restrict__ pj, T * __restrict__ fx, T * __restrict__ fy, T * __restrict__ fz) {
+    T p = 0, ax = 0, ay = 0, az = 0;
+#pragma omp simd aligned(x, y, z, q, pj, fx, fy, fz : SIMD_BYTES) reduction(+:p, ax, ay, az)
+    for (int j=0; j<nj; j++) {
+      T dx = X[0] - x[j];
+      T dy = X[1] - y[j];
+      T dz = X[2] - z[j];
+      T R2 = dx * dx + dy * dy + dz * dz;
+      T invR2 = R2 > 0 ? T(1) / R2 : T(0);
+      T invR = std::sqrt(invR2);
+      T invR3 = invR2 * invR;
+      T qjinvR3 = q[j] * invR3;
+      T qiinvR3 = qi * invR3;
+      p += q[j] * invR;
+      ax += dx * qjinvR3;
+      ay += dy * qjinvR3;
+      az += dz * qjinvR3;
+      pj[j] += qi * invR;
+      fx[j] += dx * qiinvR3;
+      fy[j] += dy * qiinvR3;
+      fz[j] += dz * qiinvR3;
+    }
+    pot += p;
+    F[0] -= ax;
+    F[1] -= ay;
+    F[2] -= az;
+  }
+
+  /**
+   * @brief P2P between two different leaf cells of one tree, updating both
+   *
+   * @details Several right-hand sides and the rsqrt paths fall back to two
+   * one-sided P2P calls. The sources accumulate into the scratch buffer of the
+   * calling thread, which reserveScratch() has allocated, and only the 4 * npad
+   * entries in use are cleared.
+   */
+  void P2Pmutual(Context & ctx, Cell * Ci, Cell * Cj) {
+    if (ctx.NRHS > 1 || ctx.rsqrtNewton >= 0) {
+      P2P(ctx, Ci, Cj);
+      P2P(ctx, Cj, Ci);
+      return;
+    }
+    EXAFMM_PROFILE_BEGIN;
+    Body * Bi = Ci->BODY;
+    Body * Bj = Cj->BODY;
+    int ni = Ci->NBODY;
+    int nj = Cj->NBODY;
+    int npad = paddedSize(nj);
+    const p2p_t * xj = Cj->SRC.data();
+    const p2p_t * yj = xj + npad;
+    const p2p_t * zj = yj + npad;
+    const p2p_t * qj = zj + npad;
+    AlignedVector & acc = ctx.scratch[omp_get_thread_num()];
+    if (acc.size() < size_t(4 * npad)) acc.resize(4 * npad);
+    std::fill(acc.begin(), acc.begin() + 4 * npad, p2p_t(0));
+    p2p_t * pj = acc.data();
+    p2p_t * fx = pj + npad;
+    p2p_t * fy = fx + npad;
+    p2p_t * fz = fy + npad;
+    for (int i=0; i<ni; i++) {
+      p2p_t X[3];
+      for (int d=0; d<3; d++) X[d] = Bi[i].X[d];
+      P2Pmutual(X, p2p_t(Bi[i].q), xj, yj, zj, qj, npad, Bi[i].p, Bi[i].F, pj, fx, fy, fz);
+    }
+    for (int j=0; j<nj; j++) {
+      Bj[j].p += pj[j];
+      Bj[j].F[0] += fx[j];
+      Bj[j].F[1] += fy[j];
+      Bj[j].F[2] += fz[j];
+    }
+    EXAFMM_PROFILE_END(ctx, kernelP2P, Ci->LEVEL, uint64_t(2) * ni * nj, uint64_t(ni) * nj * 30);
+  }
+
+  const int NBLOCK = 32;                                        //!< Number of bodies evaluated together in P2M and L2P
+
+  /**
+   * @brief Spherical angles of a block of bodies around a cell center, in SoA layout
+   *
+   * @details The cosines and sines of alpha and beta are taken directly from the
+   * cartesian offsets, so P2M and L2P need no trigonometric functions. Points on
+   * the z axis and at the center get the same angles as cart2sph.
+   *
+   * @param B First body of block
+   * @param nb Number of bodies in block
+   * @param X Center of expansion
+   * @param r Distance from center
+   * @param x,y cos(alpha), sin(alpha)
+   * @param cb,sb cos(beta), sin(beta)
+   */
+  void sphBlock(const Body * B, int nb, const real_t * X, real_t * r, real_t * x, real_t * y,
+                real_t * cb, real_t * sb) {
+    for (int b=0; b<nb; b++) {                                  // Loop over bodies in block
+      real_t dx = B[b].X[0] - X[0];                             //  x offset
+      real_t dy = B[b].X[1] - X[1];                             //  y offset
+      real_t dz = B[b].X[2] - X[2];                             //  z offset
+      real_t rxy = std::sqrt(dx * dx + dy * dy);                //  Distance from z axis
+      r[b] = std::sqrt(rxy * rxy + dz * dz);                    //  Distance from center
+      x[b] = r[b] > 0 ? dz / r[b] : 1;                          //  cos(alpha)
+      y[b] = r[b] > 0 ? rxy / r[b] : 0;                         //  sin(alpha)
+      cb[b] = rxy > 0 ? dx / rxy : 1;                           //  cos(beta)
+      sb[b] = rxy > 0 ? dy / rxy : 0;                           //  sin(beta)
+    }                                                           // End loop over bodies in block
+  }
+
+  /**
+   * @brief P2M over blocks of bodies, vectorized across the bodies of a block
+   *
+   * @details The Legendre and exp(-i m beta) recurrences of evalMultipole run for
+   * all bodies of a block at once, and each coefficient is a reduction over the
+   * block, so the harmonics of single bodies are never stored. With several
+   * right-hand sides the harmonics of a term are stored for the block and
+   * reduced against the charges of each right-hand side.
+   */
+  template<int PT, int NR>
+  void P2M(Context & ctx, Cell * C) {
+    const int P = PT ? PT : ctx.P;                              // Order of expansions
+    const int NRHS = NR ? NR : ctx.NRHS;                        // Number of right-hand sides
+    real_t r[NBLOCK], x[NBLOCK], y[NBLOCK], cb[NBLOCK], sb[NBLOCK];
+    real_t er[NBLOCK], ei[NBLOCK], pn[NBLOCK], rhom[NBLOCK];
+    real_t p[NBLOCK], p1[NBLOCK], rhon[NBLOCK];
+    real_t Yr[NBLOCK], Yi[NBLOCK], q[NR ? NR : RHSMAX][NBLOCK];
+    for (int b0=0; b0<C->NBODY; b0+=NBLOCK) {
+      int nb = std::min(NBLOCK, C->NBODY - b0);
+      sphBlock(C->BODY + b0, nb, C->X, r, x, y, cb, sb);
+      for (int b=0; b<nb; b++) {
+        er[b] = 1;
+        ei[b] = 0;
+        pn[b] = 1;
+        rhom[b] = NRHS == 1 ? C->BODY[b0+b].q : 1;
+        for (int k=0; k<NRHS; k++) q[k][b] = charge(ctx, C->BODY[b0+b], k);
+      }
+      for (int m=0; m<P; m++) {
+#pragma omp simd
+        for (int b=0; b<nb; b++) {
+          p[b] = pn[b];
+          p1[b] = 0;
+          rhon[b] = rhom[b];
+        }
+        for (int n=m; n<P; n++) {
+          real_t sr = 0, si = 0, c = 2 * n + 1, d = n + m, inv = real_t(1) / (n - m + 1);
+          if (NRHS == 1) {
+#pragma omp simd reduction(+:sr, si)
+            for (int b=0; b<nb; b++) {
+              real_t Y = rhon[b] * p[b];
+              sr += Y * er[b];
+              si += Y * ei[b];
+              real_t p2 = p1[b];
+              p1[b] = p[b];
+              p[b] = (x[b] * c * p1[b] - d * p2) * inv;
+              rhon[b] *= r[b];
+            }
+            C->M[n*(n+1)/2+m] += ctx.prefactor[n*n+n+m] * complex_t(sr, si);
+            continue;
+          }
+#pragma omp simd
+          for (int b=0; b<nb; b++) {
+            real_t Y = rhon[b] * p[b];
+            Yr[b] = Y * er[b];
+            Yi[b] = Y * ei[b];
+            real_t p2 = p1[b];
+            p1[b] = p[b];
+            p[b] = (x[b] * c * p1[b] - d * p2) * inv;
+            rhon[b] *= r[b];
+          }
+          for (int k=0; k<NRHS; k++) {
+            sr = si = 0;
+#pragma omp simd reduction(+:sr, si)
+            for (int b=0; b<nb; b++) {
+              sr += q[k][b] * Yr[b];
+              si += q[k][b] * Yi[b];
+            }
+            C->M[k*ctx.NTERM+n*(n+1)/2+m] += ctx.prefactor[n*n+n+m] * complex_t(sr, si);
+          }
+        }
+#pragma omp simd
+        for (int b=0; b<nb; b++) {
+          pn[b] = -pn[b] * (2 * m + 1) * y[b];
+          rhom[b] *= r[b];
+          real_t e = er[b] * cb[b] + ei[b] * sb[b];
+          ei[b] = ei[b] * cb[b] - er[b] * sb[b];
+          er[b] = e;
         }
       }
     }
   }
 
-  void M2M(Cell * Ci) {
-    complex_t Ynm[P*P], YnmTheta[P*P];
+  void P2M(Context & ctx, Cell * C) {
+    EXAFMM_PROFILE_BEGIN;
+    EXAFMM_DISPATCH_RHS(P2M, ctx, C);
+    EXAFMM_PROFILE_END(ctx, kernelP2M, C->LEVEL, C->NBODY, uint64_t(C->NBODY) * (12 + 4 * ctx.NRHS) * ctx.P * ctx.P);
+  }
+
+  /**
+   * @brief Harmonics of a parent-child offset, from the 8 cached unit offsets
+   *
+   * @param cache M2Mcache or L2Lcache
+   * @param dX Offset of child center from parent center
+   * @param R Radius of child cell
+   * @param Ynm Harmonics, scaled by \f$ R^n \f$
+   * @return False if the child is not at a corner offset of the parent
+   */
+  template<int PT>
+  bool getChild(Context & ctx, const std::vector<complex_t> & cache, real_t * dX, real_t R, complex_t * Ynm) {
+    const int P = PT ? PT : ctx.P;                              // Order of expansions
+    int octant = 0;                                             // Octant of child
+    for (int d=0; d<3; d++) {                                   // Loop over dimensions
+      if (std::abs(std::abs(dX[d]) - R) > 1e-6 * R) return false;// Not a corner offset
+      octant += (dX[d] > 0) << d;                               //  Octant bit
+    }                                                           // End loop over dimensions
+    const complex_t * Y = &cache[octant*P*P];                   // Unit harmonics
+    real_t Rn = 1;                                              // R^n
+    for (int n=0; n<P; n++) {                                   // Loop over n
+      for (int m=-n; m<=n; m++) Ynm[n*n+n+m] = Y[n*n+n+m] * Rn; //  Scale harmonics
+      Rn *= R;                                                  //  Update R^n
+    }                                                           // End loop over n
+    return true;                                                // Cached
+  }
+
+  template<int PT, int NR>
+  void M2M(Context & ctx, Cell * Ci) {
+    const int P = PT ? PT : ctx.P;                              // Order of expansions
+    const int NRHS = NR ? NR : ctx.NRHS;                        // Number of right-hand sides
+    constexpr int PC = PT ? PT : PMAX;                          // Order for the size of scratch arrays
+    complex_t Ynm[PC*PC], YnmTheta[PC*PC];
+    real_t dX[3];
     for (Cell * Cj=Ci->CHILD; Cj!=Ci->CHILD+Ci->NCHILD; Cj++) {
-      for (int d=0; d<3; d++) dX[d] = Ci->X[d] - Cj->X[d];
-      real_t rho, alpha, beta;
-      cart2sph(dX, rho, alpha, beta);
-      evalMultipole(rho, alpha, -beta, Ynm, YnmTheta);
+      for (int d=0; d<3; d++) dX[d] = Cj->X[d] - Ci->X[d];
+      if (!getChild<PT>(ctx, ctx.M2Mcache, dX, Cj->R, Ynm)) {
+        for (int d=0; d<3; d++) dX[d] = -dX[d];
+        real_t rho, alpha, beta;
+        cart2sph(dX, rho, alpha, beta);
+        evalMultipole<PT>(ctx, rho, alpha, -beta, Ynm, YnmTheta);
+      }
       for (int j=0; j<P; j++) {
         for (int k=0; k<=j; k++) {
           int jk = j * j + j + k;
           int jks = j * (j + 1) / 2 + k;
-          complex_t M = 0;
+          complex_t M[NR ? NR : RHSMAX] = {};
           for (int n=0; n<=j; n++) {
             for (int m=-n; m<=std::min(k-1,n); m++) {
               if (j-n >= k-m) {
                 int jnkm  = (j - n) * (j - n) + j - n + k - m;
                 int jnkms = (j - n) * (j - n + 1) / 2 + k - m;
                 int nm    = n * n + n + m;
-                M += Cj->M[jnkms] * std::pow(I,real_t(m-abs(m))) * Ynm[nm]
-                  * real_t(oddOrEven(n) * Anm[nm] * Anm[jnkm] / Anm[jk]);
+                for (int r=0; r<NRHS; r++) {
+                  M[r] += complex_t(Cj->M[r*ctx.NTERM+jnkms]) * Ynm[nm]
+                    * real_t(oddOrEven(n + std::min(m,0)) * ctx.Anm[nm] * ctx.Anm[jnkm] / ctx.Anm[jk]);
+                }
               }
             }
             for (int m=k; m<=n; m++) {
@@ -213,114 +871,617 @@ namespace exafmm {
                 int jnkm  = (j - n) * (j - n) + j - n + k - m;
                 int jnkms = (j - n) * (j - n + 1) / 2 - k + m;
                 int nm    = n * n + n + m;
-                M += std::conj(Cj->M[jnkms]) * Ynm[nm]
-                  * real_t(oddOrEven(k+n+m) * Anm[nm] * Anm[jnkm] / Anm[jk]);
+                for (int r=0; r<NRHS; r++) {
+                  M[r] += std::conj(complex_t(Cj->M[r*ctx.NTERM+jnkms])) * Ynm[nm]
+                    * real_t(oddOrEven(k+n+m) * ctx.Anm[nm] * ctx.Anm[jnkm] / ctx.Anm[jk]);
+                }
               }
             }
           }
-          Ci->M[jks] += M;
+          for (int r=0; r<NRHS; r++) Ci->M[r*ctx.NTERM+jks] += M[r];
         }
       }
     }
   }
 
-  void M2L(Cell * Ci, Cell * Cj) {
-    complex_t Ynm2[4*P*P];
-    for (int d=0; d<3; d++) dX[d] = Ci->X[d] - Cj->X[d] - Xperiodic[d];
+  void M2M(Context & ctx, Cell * Ci) {
+    EXAFMM_PROFILE_BEGIN;
+    EXAFMM_DISPATCH_RHS(M2M, ctx, Ci);
+    EXAFMM_PROFILE_END(ctx, kernelM2M, Ci->LEVEL, Ci->NCHILD, uint64_t(Ci->NCHILD) * 2 * ctx.NRHS * ctx.P * ctx.P * ctx.P * ctx.P);
+  }
+
+  /**
+   * @brief Rotate one degree of an expansion about the y axis
+   *
+   * @details Uses \f$ R_y(\alpha) = S R_z(\alpha) S^{-1} \f$, so the dense part is
+   * the two fixed matrices Dnm and DnmInv and the angle only enters through phases.
+   * Only m >= 0 is computed since the coefficients of a real field satisfy
+   * \f$ C_n^{-m} = \overline{C_n^m} \f$ in every frame.
+   *
+   * @param n Degree
+   * @param eia Powers exp(i * a * alpha) for a = 0..n
+   * @param v Coefficients for m = -n..n, overwritten
+   * @param out Rotated coefficients for m = 0..n
+   */
+  template<int PT>
+  void rotateY(Context & ctx, int n, const complex_t * eia, complex_t * v, complex_t * out) {
+    constexpr int PC = PT ? PT : PMAX;                          // Order for the size of scratch arrays
+    int offset = (4*n*n*n - n) / 3;                             // Offset of degree n block
+    int size = 2 * n + 1;                                       // Size of block
+    complex_t w[2*PC-1];                                        // Coefficients in intermediate frame
+    for (int a=0; a<=n; a++) {                                  // Loop over m >= 0 of intermediate frame
+      complex_t sum = 0;                                        //  Initialize sum
+      for (int m=-n; m<=n; m++) {                               //  Loop over m of input
+        sum += v[n+m] * ctx.Dnm[offset+(n+m)*size+n+a];         //   Apply S
+      }                                                         //  End loop over m of input
+      w[n+a] = sum * eia[a];                                    //  Rotate about z in intermediate frame
+      w[n-a] = std::conj(w[n+a]);                               //  Conjugate relation for m < 0
+    }                                                           // End loop over m >= 0
+    for (int m=0; m<=n; m++) {                                  // Loop over m >= 0 of output
+      complex_t sum = 0;                                        //  Initialize sum
+      for (int a=-n; a<=n; a++) {                               //  Loop over m of intermediate frame
+        sum += w[n+a] * ctx.DnmInv[offset+(n+a)*size+n+m];      //   Apply S^-1
+      }                                                         //  End loop over m of intermediate frame
+      out[m] = sum;                                             //  Rotated coefficient
+    }                                                           // End loop over m >= 0
+  }
+
+  /**
+   * @brief M2L by rotation, translation along z, and rotation back
+   *
+   * @details The frame is rotated so that the distance vector is the z axis,
+   * where the translation only couples equal orders m. Each step is O(p^3).
+   * The angles and powers of rho are shared by all right-hand sides.
+   */
+  template<int PT, int NR>
+  void M2Lrotate(Context & ctx, Cell * Ci, Cell * Cj) {
+    const int P = PT ? PT : ctx.P;                              // Order of expansions
+    const int NRHS = NR ? NR : ctx.NRHS;                        // Number of right-hand sides
+    constexpr int PC = PT ? PT : PMAX;                          // Order for the size of scratch arrays
+    real_t dX[3];
+    for (int d=0; d<3; d++) dX[d] = Ci->X[d] - Cj->X[d] - ctx.Xperiodic[d];
     real_t rho, alpha, beta;
     cart2sph(dX, rho, alpha, beta);
-    evalLocal(rho, alpha, beta, Ynm2);
+    complex_t eia[PC], eib[PC], v[2*PC];
+    complex_t Mrot[PC*(PC+1)/2], Lrot[PC*(PC+1)/2];
+    real_t invRho[2*PC];
+    complex_t ea = std::exp(I * alpha), eb = std::exp(I * beta);
+    eia[0] = eib[0] = 1;
+    for (int m=1; m<P; m++) {
+      eia[m] = eia[m-1] * ea;
+      eib[m] = eib[m-1] * eb;
+    }
+    invRho[0] = 1 / rho;
+    for (int n=1; n<2*P; n++) invRho[n] = invRho[n-1] / rho;
+    complex_t eiaConj[PC];
+    for (int m=0; m<P; m++) eiaConj[m] = std::conj(eia[m]);
+    for (int r=0; r<NRHS; r++) {
+      const coef_t * Mj = Cj->M + r * ctx.NTERM;
+      coef_t * Li = Ci->L + r * ctx.NTERM;
+      for (int n=0; n<P; n++) {
+        for (int m=0; m<=n; m++) {
+          v[n+m] = complex_t(Mj[n*(n+1)/2+m]) * eib[m];
+          v[n-m] = std::conj(v[n+m]);
+        }
+        rotateY<PT>(ctx, n, eia, v, &Mrot[n*(n+1)/2]);
+      }
+      for (int j=0; j<P; j++) {
+        for (int k=0; k<=j; k++) {
+          int jk = j * j + j + k;
+          complex_t L = 0;
+          for (int n=k; n<P; n++) {
+            L += Mrot[n*(n+1)/2+k] * ctx.Cnm[jk*P*P+n*n+n+k] * invRho[j+n];
+          }
+          Lrot[j*(j+1)/2+k] = L;
+        }
+      }
+      for (int j=0; j<P; j++) {
+        for (int k=0; k<=j; k++) {
+          v[j+k] = Lrot[j*(j+1)/2+k];
+          v[j-k] = std::conj(v[j+k]);
+        }
+        complex_t L[PC];
+        rotateY<PT>(ctx, j, eiaConj, v, L);
+        for (int k=0; k<=j; k++) {
+          Li[j*(j+1)/2+k] += L[k] * std::conj(eib[k]);
+        }
+      }
+    }
+  }
+
+  //! Key of the integer offset dX / R, false if dX is not on the lattice of spacing R
+  bool getKey(real_t * dX, real_t R, uint64_t & key) {
+    key = 0;                                                    // Initialize key
+    for (int d=0; d<3; d++) {                                   // Loop over dimensions
+      real_t x = dX[d] / R;                                     //  Offset in units of R
+      int ix = int(std::lround(x));                             //  Nearest integer
+      if (std::abs(x - ix) > 1e-6 || std::abs(ix) >= (1 << 20)) return false;// Check lattice and key range
+      key |= uint64_t(ix + (1 << 20)) << (21 * d);              //  Pack 21 bits per dimension
+    }                                                           // End loop over dimensions
+    return true;                                                // On the lattice
+  }
+
+  //! Singular harmonics of the integer offset of a key, evaluated once and cached
+  const complex_t * getLocal(Context & ctx, uint64_t key) {
+    {                                                           // Scope of shared lock
+      std::shared_lock<std::shared_mutex> lock(ctx.M2Lmutex);   //  Concurrent lookups
+      auto it = ctx.M2Lcache.find(key);                         //  Find offset
+      if (it != ctx.M2Lcache.end()) return it->second.data();   //  Hit; nodes are never erased
+    }                                                           // End scope of shared lock
+    std::vector<complex_t> Ynm(4*ctx.P*ctx.P);                  // New entry
+    real_t X[3], rho, alpha, beta;                              // Integer offset and spherical coordinates
+    for (int d=0; d<3; d++) X[d] = int((key >> (21 * d)) & ((1 << 21) - 1)) - (1 << 20);// Unpack offset
+    cart2sph(X, rho, alpha, beta);                              // Spherical coordinates
+    evalLocal(ctx, rho, alpha, beta, Ynm.data());               // Evaluate unit harmonics
+    std::unique_lock<std::shared_mutex> lock(ctx.M2Lmutex);     // Exclusive insertion
+    return ctx.M2Lcache.emplace(key, std::move(Ynm)).first->second.data();// Keep the first insertion
+  }
+
+  /**
+   * @brief Singular harmonics for M2L, cached when the distance vector is on the lattice
+   *
+   * @details Cell centers of one tree are odd multiples of the cell radius from
+   * the corner of the root, so the distance between any two cells is an integer
+   * multiple of the smaller radius R. The harmonics of the integer offset dX / R
+   * are stored once, and \f$ \rho^{-n-1} \f$ scaling makes them valid on every
+   * level and for every root size, so the cache carries over to later time steps.
+   *
+   * @param dX Distance vector
+   * @param R Length unit of the lattice
+   * @param Ynm2 Buffer used when dX is not on the lattice
+   * @param scale Length unit of the returned harmonics, R if cached and 1 otherwise
+   * @return Harmonics of dX / scale
+   */
+  const complex_t * getLocal(Context & ctx, real_t * dX, real_t R, complex_t * Ynm2, real_t & scale) {
+    uint64_t key;                                               // Key of integer offset
+    if (getKey(dX, R, key)) {                                   // If on the lattice
+      scale = R;                                                //  Harmonics are in units of R
+      return getLocal(ctx, key);                                //  Cached harmonics
+    }                                                           // End if for lattice
+    scale = 1;                                                  // Harmonics are not scaled
+    real_t rho, alpha, beta;                                    // Spherical coordinates
+    cart2sph(dX, rho, alpha, beta);                             // Spherical coordinates
+    evalLocal(ctx, rho, alpha, beta, Ynm2);                     // Evaluate into buffer
+    return Ynm2;                                                // Return buffer
+  }
+
+  template<int PT, int NR>
+  void M2L(Context & ctx, Cell * Ci, Cell * Cj) {
+    if (ctx.rotateM2L) {
+      M2Lrotate<PT, NR>(ctx, Ci, Cj);
+      return;
+    }
+    const int P = PT ? PT : ctx.P;                              // Order of expansions
+    const int NRHS = NR ? NR : ctx.NRHS;                        // Number of right-hand sides
+    constexpr int PC = PT ? PT : PMAX;                          // Order for the size of scratch arrays
+    constexpr int RC = NR ? NR : RHSMAX;                        // Right-hand sides for the size of scratch arrays
+    constexpr int NC = PC * (PC + 1) / 2;                       // Stride of scaled multipoles
+    complex_t Ynm2[4*PC*PC], M[RC*NC];
+    real_t dX[3];
+    for (int d=0; d<3; d++) dX[d] = Ci->X[d] - Cj->X[d] - ctx.Xperiodic[d];
+    real_t scale;
+    const complex_t * Ynm = getLocal(ctx, dX, std::min(Ci->R, Cj->R), Ynm2, scale);
+    real_t invScale = 1 / scale, scaleN = 1;
+    for (int n=0; n<P; n++) {
+      for (int m=0; m<=n; m++) {
+        for (int r=0; r<NRHS; r++) M[r*NC+n*(n+1)/2+m] = complex_t(Cj->M[r*ctx.NTERM+n*(n+1)/2+m]) * scaleN;
+      }
+      scaleN *= invScale;
+    }
+    real_t scaleJ = invScale;
+    for (int j=0; j<P; j++) {
+      for (int k=0; k<=j; k++) {
+        int jk = j * j + j + k;
+        int jks = j * (j + 1) / 2 + k;
+        complex_t L[NR ? NR : RHSMAX] = {};
+        for (int n=0; n<P; n++) {
+          for (int m=-n; m<0; m++) {
+            int nm   = n * n + n + m;
+            int nms  = n * (n + 1) / 2 - m;
+            int jknm = jk * P * P + nm;
+            int jnkm = (j + n) * (j + n) + j + n + m - k;
+            if (NR == 1) {
+              L[0] += std::conj(M[nms]) * ctx.Cnm[jknm] * Ynm[jnkm];
+            } else {
+              complex_t Y = ctx.Cnm[jknm] * Ynm[jnkm];
+              for (int r=0; r<NRHS; r++) L[r] += std::conj(M[r*NC+nms]) * Y;
+            }
+          }
+          for (int m=0; m<=n; m++) {
+            int nm   = n * n + n + m;
+            int nms  = n * (n + 1) / 2 + m;
+            int jknm = jk * P * P + nm;
+            int jnkm = (j + n) * (j + n) + j + n + m - k;
+            if (NR == 1) {
+              L[0] += M[nms] * ctx.Cnm[jknm] * Ynm[jnkm];
+            } else {
+              complex_t Y = ctx.Cnm[jknm] * Ynm[jnkm];
+              for (int r=0; r<NRHS; r++) L[r] += M[r*NC+nms] * Y;
+            }
+          }
+        }
+        for (int r=0; r<NRHS; r++) Ci->L[r*ctx.NTERM+jks] += L[r] * scaleJ;
+      }
+      scaleJ *= invScale;
+    }
+  }
+
+  void M2L(Context & ctx, Cell * Ci, Cell * Cj) {
+    EXAFMM_PROFILE_BEGIN;
+    EXAFMM_DISPATCH_RHS(M2L, ctx, Ci, Cj);
+    EXAFMM_PROFILE_END(ctx, kernelM2L, Ci->LEVEL, 1, ctx.NRHS * (ctx.rotateM2L ? uint64_t(24) * ctx.P * ctx.P * ctx.P : uint64_t(4) * ctx.P * ctx.P * ctx.P * ctx.P));
+  }
+
+  /**
+   * @brief M2L between two cells of one tree in both directions
+   *
+   * @details The singular harmonics of -dX are those of dX times
+   * \f$ (-1)^{j+n} \f$, so one set of harmonics serves both directions. The sign
+   * is folded into the scaled multipoles of Ci for n and into the result for j.
+   * Xperiodic must be zero.
+   */
+  template<int PT, int NR>
+  void M2Lmutual(Context & ctx, Cell * Ci, Cell * Cj) {
+    if (ctx.rotateM2L) {
+      M2Lrotate<PT, NR>(ctx, Ci, Cj);
+      M2Lrotate<PT, NR>(ctx, Cj, Ci);
+      return;
+    }
+    const int P = PT ? PT : ctx.P;                              // Order of expansions
+    const int NRHS = NR ? NR : ctx.NRHS;                        // Number of right-hand sides
+    constexpr int PC = PT ? PT : PMAX;                          // Order for the size of scratch arrays
+    constexpr int RC = NR ? NR : RHSMAX;                        // Right-hand sides for the size of scratch arrays
+    constexpr int NC = PC * (PC + 1) / 2;                       // Stride of scaled multipoles
+    complex_t Ynm2[4*PC*PC], Mi[RC*NC], Mj[RC*NC];
+    real_t dX[3];
+    for (int d=0; d<3; d++) dX[d] = Ci->X[d] - Cj->X[d];
+    real_t scale;
+    const complex_t * Ynm = getLocal(ctx, dX, std::min(Ci->R, Cj->R), Ynm2, scale);
+    real_t invScale = 1 / scale, scaleN = 1;
+    for (int n=0; n<P; n++) {
+      for (int m=0; m<=n; m++) {
+        for (int r=0; r<NRHS; r++) {
+          Mi[r*NC+n*(n+1)/2+m] = complex_t(Ci->M[r*ctx.NTERM+n*(n+1)/2+m]) * (scaleN * oddOrEven(n));
+          Mj[r*NC+n*(n+1)/2+m] = complex_t(Cj->M[r*ctx.NTERM+n*(n+1)/2+m]) * scaleN;
+        }
+      }
+      scaleN *= invScale;
+    }
+    real_t scaleJ = invScale;
     for (int j=0; j<P; j++) {
       for (int k=0; k<=j; k++) {
         int jk = j * j + j + k;
         int jks = j * (j + 1) / 2 + k;
-        complex_t L = 0;
+        complex_t Li[RC] = {}, Lj[RC] = {};
         for (int n=0; n<P; n++) {
           for (int m=-n; m<0; m++) {
             int nm   = n * n + n + m;
             int nms  = n * (n + 1) / 2 - m;
             int jknm = jk * P * P + nm;
             int jnkm = (j + n) * (j + n) + j + n + m - k;
-            L += std::conj(Cj->M[nms]) * Cnm[jknm] * Ynm2[jnkm];
+            complex_t Y = ctx.Cnm[jknm] * Ynm[jnkm];
+            for (int r=0; r<NRHS; r++) {
+              Li[r] += std::conj(Mj[r*NC+nms]) * Y;
+              Lj[r] += std::conj(Mi[r*NC+nms]) * Y;
+            }
           }
           for (int m=0; m<=n; m++) {
             int nm   = n * n + n + m;
             int nms  = n * (n + 1) / 2 + m;
             int jknm = jk * P * P + nm;
             int jnkm = (j + n) * (j + n) + j + n + m - k;
-            L += Cj->M[nms] * Cnm[jknm] * Ynm2[jnkm];
+            complex_t Y = ctx.Cnm[jknm] * Ynm[jnkm];
+            for (int r=0; r<NRHS; r++) {
+              Li[r] += Mj[r*NC+nms] * Y;
+              Lj[r] += Mi[r*NC+nms] * Y;
+            }
+          }
+        }
+        for (int r=0; r<NRHS; r++) {
+          Ci->L[r*ctx.NTERM+jks] += Li[r] * scaleJ;
+          Cj->L[r*ctx.NTERM+jks] += Lj[r] * (scaleJ * oddOrEven(j));
+        }
+      }
+      scaleJ *= invScale;
+    }
+  }
+
+  void M2Lmutual(Context & ctx, Cell * Ci, Cell * Cj) {
+    EXAFMM_PROFILE_BEGIN;
+    EXAFMM_DISPATCH_RHS(M2Lmutual, ctx, Ci, Cj);
+    EXAFMM_PROFILE_END(ctx, kernelM2L, Ci->LEVEL, 2, ctx.NRHS * (ctx.rotateM2L ? uint64_t(48) * ctx.P * ctx.P * ctx.P : uint64_t(6) * ctx.P * ctx.P * ctx.P * ctx.P));
+  }
+
+  //! Dense C += A * B for row-major A (m x k), B (k x n) and C (m x n)
+  void gemm(int m, int n, int k, const real_t * A, const real_t * B, real_t * C) {
+    for (int i=0; i<m; i++) {
+      for (int l=0; l<k; l++) {
+        real_t a = A[i*k+l];
+#pragma omp simd
+        for (int j=0; j<n; j++) C[i*n+j] += a * B[l*n+j];
+      }
+    }
+  }
+
+  /**
+   * @brief Real matrix of the M2L operator for unit harmonics Ynm
+   *
+   * @details The operator maps (Re M, Im M) to (Re L, Im L). It is real-linear but
+   * not complex-linear since M for m < 0 enters through its conjugate.
+   *
+   * @param Ynm Singular harmonics of the unit offset
+   * @param T Matrix of size 2*NTERM x 2*NTERM
+   */
+  void M2Lmatrix(Context & ctx, const complex_t * Ynm, real_t * T) {
+    int N = 2 * ctx.NTERM;
+    for (int j=0; j<ctx.P; j++) {
+      for (int k=0; k<=j; k++) {
+        int jk = j * j + j + k;
+        int jks = j * (j + 1) / 2 + k;
+        for (int n=0; n<ctx.P; n++) {
+          for (int m=0; m<=n; m++) {
+            int nms = n * (n + 1) / 2 + m;
+            complex_t A = ctx.Cnm[jk*ctx.P*ctx.P+n*n+n+m] * Ynm[(j+n)*(j+n)+j+n+m-k];
+            complex_t B = 0;
+            if (m > 0) B = ctx.Cnm[jk*ctx.P*ctx.P+n*n+n-m] * Ynm[(j+n)*(j+n)+j+n-m-k];
+            T[jks*N+nms]               = std::real(A) + std::real(B);
+            T[jks*N+ctx.NTERM+nms]         = std::imag(B) - std::imag(A);
+            T[(ctx.NTERM+jks)*N+nms]       = std::imag(A) + std::imag(B);
+            T[(ctx.NTERM+jks)*N+ctx.NTERM+nms] = std::real(A) - std::real(B);
+          }
+        }
+      }
+    }
+  }
+
+  typedef std::pair<Cell *, Cell *> CellPair;                   //!< Pair of target and source cells
+  const int NBATCH = 128;                                       //!< Maximum number of pairs per matrix product
+
+  /**
+   * @brief Batched M2L for many cell pairs
+   *
+   * @details Pairs are grouped by the integer offset of their distance vector, and
+   * each group of up to NBATCH pairs is evaluated as one matrix-matrix product with
+   * the real operator of that offset. The R^-n and R^-(j+1) scaling of each pair is
+   * applied when packing and unpacking, so groups mix pairs from all levels. Pairs
+   * that are not on the lattice fall back to M2L. Each right-hand side of a pair
+   * is one more column of the product. A target can appear in several
+   * groups, so results are added under a lock striped by target address. The
+   * profiler counts each group as one M2L call at the level of its first target.
+   *
+   * @param pairs Target and source cells
+   */
+  void M2Lbatch(Context & ctx, const std::vector<CellPair> & pairs) {
+    std::vector<std::pair<uint64_t, int> > keys;
+    std::vector<int> others;
+    for (int i=0; i<int(pairs.size()); i++) {
+      real_t dX[3];
+      for (int d=0; d<3; d++) dX[d] = pairs[i].first->X[d] - pairs[i].second->X[d] - ctx.Xperiodic[d];
+      uint64_t key;
+      if (getKey(dX, std::min(pairs[i].first->R, pairs[i].second->R), key)) keys.push_back(std::make_pair(key, i));
+      else others.push_back(i);
+    }
+    std::sort(keys.begin(), keys.end());
+    std::vector<int> blocks;
+    for (int i=0; i<int(keys.size()); i++) {
+      if (i == 0 || keys[i].first != keys[i-1].first || i - blocks.back() == NBATCH) blocks.push_back(i);
+    }
+    blocks.push_back(keys.size());
+    int N = 2 * ctx.NTERM;
+#pragma omp parallel
+    {
+      std::vector<real_t> T(N*N), X(N*NBATCH*ctx.NRHS), Y(N*NBATCH*ctx.NRHS);
+#pragma omp for schedule(dynamic)
+      for (int b=0; b<int(blocks.size())-1; b++) {
+        EXAFMM_PROFILE_BEGIN;
+        int begin = blocks[b], nb = blocks[b+1] - begin, nc = nb * ctx.NRHS;
+        M2Lmatrix(ctx, getLocal(ctx, keys[begin].first), T.data());
+        for (int p=0; p<nb; p++) {
+          const CellPair & pair = pairs[keys[begin+p].second];
+          real_t invR = 1 / std::min(pair.first->R, pair.second->R), scale = 1;
+          for (int n=0; n<ctx.P; n++) {
+            for (int m=0; m<=n; m++) {
+              int nms = n * (n + 1) / 2 + m;
+              for (int r=0; r<ctx.NRHS; r++) {
+                X[nms*nc+p*ctx.NRHS+r] = std::real(pair.second->M[r*ctx.NTERM+nms]) * scale;
+                X[(ctx.NTERM+nms)*nc+p*ctx.NRHS+r] = std::imag(pair.second->M[r*ctx.NTERM+nms]) * scale;
+              }
+            }
+            scale *= invR;
           }
         }
-        Ci->L[jks] += L;
+        std::fill(Y.begin(), Y.begin()+N*nc, 0);
+        gemm(N, nc, N, T.data(), X.data(), Y.data());
+        for (int p=0; p<nb; p++) {
+          const CellPair & pair = pairs[keys[begin+p].second];
+          real_t invR = 1 / std::min(pair.first->R, pair.second->R), scale = invR;
+          std::lock_guard<std::mutex> lock(ctx.M2Llocks[(uintptr_t(pair.first) / sizeof(Cell)) % 256]);
+          for (int j=0; j<ctx.P; j++) {
+            for (int k=0; k<=j; k++) {
+              int jks = j * (j + 1) / 2 + k;
+              for (int r=0; r<ctx.NRHS; r++) {
+                pair.first->L[r*ctx.NTERM+jks] += complex_t(Y[jks*nc+p*ctx.NRHS+r], Y[(ctx.NTERM+jks)*nc+p*ctx.NRHS+r]) * scale;
+              }
+            }
+            scale *= invR;
+          }
+        }
+        EXAFMM_PROFILE_END(ctx, kernelM2L, pairs[keys[begin].second].first->LEVEL, nb, uint64_t(2) * N * N * nc);
+      }
+#pragma omp for schedule(dynamic)
+      for (int i=0; i<int(others.size()); i++) {
+        const CellPair & pair = pairs[others[i]];
+        std::lock_guard<std::mutex> lock(ctx.M2Llocks[(uintptr_t(pair.first) / sizeof(Cell)) % 256]);
+        M2L(ctx, pair.first, pair.second);
       }
     }
   }
 
-  void L2L(Cell * Cj) {
-    complex_t Ynm[P*P], YnmTheta[P*P];
+  template<int PT, int NR>
+  void L2L(Context & ctx, Cell * Cj) {
+    const int P = PT ? PT : ctx.P;                              // Order of expansions
+    const int NRHS = NR ? NR : ctx.NRHS;                        // Number of right-hand sides
+    constexpr int PC = PT ? PT : PMAX;                          // Order for the size of scratch arrays
+    complex_t Ynm[PC*PC], YnmTheta[PC*PC];
+    real_t dX[3];
     for (Cell * Ci=Cj->CHILD; Ci!=Cj->CHILD+Cj->NCHILD; Ci++) {
       for (int d=0; d<3; d++) dX[d] = Ci->X[d] - Cj->X[d];
-      real_t rho, alpha, beta;
-      cart2sph(dX, rho, alpha, beta);
-      evalMultipole(rho, alpha, beta, Ynm, YnmTheta);
+      if (!getChild<PT>(ctx, ctx.L2Lcache, dX, Ci->R, Ynm)) {
+        real_t rho, alpha, beta;
+        cart2sph(dX, rho, alpha, beta);
+        evalMultipole<PT>(ctx, rho, alpha, beta, Ynm, YnmTheta);
+      }
       for (int j=0; j<P; j++) {
         for (int k=0; k<=j; k++) {
           int jk = j * j + j + k;
           int jks = j * (j + 1) / 2 + k;
-          complex_t L = 0;
+          complex_t L[NR ? NR : RHSMAX] = {};
           for (int n=j; n<P; n++) {
             for (int m=j+k-n; m<0; m++) {
               int jnkm = (n - j) * (n - j) + n - j + m - k;
               int nm   = n * n + n - m;
               int nms  = n * (n + 1) / 2 - m;
-              L += std::conj(Cj->L[nms]) * Ynm[jnkm]
-                * real_t(oddOrEven(k) * Anm[jnkm] * Anm[jk] / Anm[nm]);
+              for (int r=0; r<NRHS; r++) {
+                L[r] += std::conj(complex_t(Cj->L[r*ctx.NTERM+nms])) * Ynm[jnkm]
+                  * real_t(oddOrEven(k) * ctx.Anm[jnkm] * ctx.Anm[jk] / ctx.Anm[nm]);
+              }
             }
             for (int m=0; m<=n; m++) {
               if (n-j >= abs(m-k)) {
                 int jnkm = (n - j) * (n - j) + n - j + m - k;
                 int nm   = n * n + n + m;
                 int nms  = n * (n + 1) / 2 + m;
-                L += Cj->L[nms] * std::pow(I,real_t(m-k-abs(m-k)))
-                  * Ynm[jnkm] * Anm[jnkm] * Anm[jk] / Anm[nm];
+                for (int r=0; r<NRHS; r++) {
+                  L[r] += complex_t(Cj->L[r*ctx.NTERM+nms]) * Ynm[jnkm]
+                    * real_t(oddOrEven(std::min(m-k,0)) * ctx.Anm[jnkm] * ctx.Anm[jk] / ctx.Anm[nm]);
+                }
               }
             }
           }
-          Ci->L[jks] += L;
+          for (int r=0; r<NRHS; r++) Ci->L[r*ctx.NTERM+jks] += L[r];
         }
       }
     }
   }
 
-  void L2P(Cell * Ci) {
-    complex_t Ynm[P*P], YnmTheta[P*P];
-    for (Body * B=Ci->BODY; B!=Ci->BODY+Ci->NBODY; B++) {
-      for (int d=0; d<3; d++) dX[d] = B->X[d] - Ci->X[d];
-      real_t spherical[3] = {0, 0, 0};
-      real_t cartesian[3] = {0, 0, 0};
-      real_t r, theta, phi;
-      cart2sph(dX, r, theta, phi);
-      evalMultipole(r, theta, phi, Ynm, YnmTheta);
-      for (int n=0; n<P; n++) {
-        int nm  = n * n + n;
-        int nms = n * (n + 1) / 2;
-        B->p += std::real(Ci->L[nms] * Ynm[nm]);
-        spherical[0] += std::real(Ci->L[nms] * Ynm[nm]) / r * n;
-        spherical[1] += std::real(Ci->L[nms] * YnmTheta[nm]);
-        for (int m=1; m<=n; m++) {
-          nm  = n * n + n + m;
-          nms = n * (n + 1) / 2 + m;
-          B->p += 2 * std::real(Ci->L[nms] * Ynm[nm]);
-          spherical[0] += 2 * std::real(Ci->L[nms] * Ynm[nm]) / r * n;
-          spherical[1] += 2 * std::real(Ci->L[nms] * YnmTheta[nm]);
-          spherical[2] += 2 * std::real(Ci->L[nms] * Ynm[nm] * I) * m;
+  void L2L(Context & ctx, Cell * Cj) {
+    EXAFMM_PROFILE_BEGIN;
+    EXAFMM_DISPATCH_RHS(L2L, ctx, Cj);
+    EXAFMM_PROFILE_END(ctx, kernelL2L, Cj->LEVEL, Cj->NCHILD, uint64_t(Cj->NCHILD) * 2 * ctx.NRHS * ctx.P * ctx.P * ctx.P * ctx.P);
+  }
+
+  /**
+   * @brief L2P over blocks of bodies, vectorized across the bodies of a block
+   *
+   * @details Potential and spherical gradient are accumulated per body with the
+   * recurrences of evalMultipole. The 1/r and 1/sin(alpha) factors of the
+   * gradient are common to all terms, so they are applied once per body. With
+   * several right-hand sides the harmonics of a term are stored for the block
+   * and contracted with the local coefficients of each right-hand side.
+   */
+  template<int PT, int NR>
+  void L2P(Context & ctx, Cell * Ci) {
+    const int P = PT ? PT : ctx.P;                              // Order of expansions
+    const int NRHS = NR ? NR : ctx.NRHS;                        // Number of right-hand sides
+    real_t r[NBLOCK], x[NBLOCK], y[NBLOCK], cb[NBLOCK], sb[NBLOCK];
+    real_t er[NBLOCK], ei[NBLOCK], pn[NBLOCK], rhom[NBLOCK];
+    real_t p[NBLOCK], p1[NBLOCK], rhon[NBLOCK];
+    constexpr int RC = NR ? NR : RHSMAX;                        // Right-hand sides for the size of scratch arrays
+    real_t pot[RC][NBLOCK], s0[RC][NBLOCK], s1[RC][NBLOCK], s2[RC][NBLOCK];
+    real_t Yr[NBLOCK], Yi[NBLOCK], Yp[NBLOCK], Yt[NBLOCK];
+    for (int b0=0; b0<Ci->NBODY; b0+=NBLOCK) {
+      int nb = std::min(NBLOCK, Ci->NBODY - b0);
+      sphBlock(Ci->BODY + b0, nb, Ci->X, r, x, y, cb, sb);
+      for (int b=0; b<nb; b++) {
+        er[b] = 1;
+        ei[b] = 0;
+        pn[b] = 1;
+        rhom[b] = 1;
+        for (int k=0; k<NRHS; k++) pot[k][b] = s0[k][b] = s1[k][b] = s2[k][b] = 0;
+      }
+      for (int m=0; m<P; m++) {
+#pragma omp simd
+        for (int b=0; b<nb; b++) {
+          p[b] = pn[b];
+          p1[b] = 0;
+          rhon[b] = rhom[b];
+        }
+        for (int n=m; n<P; n++) {
+          int nms = n * (n + 1) / 2 + m;
+          real_t w = (m ? 2 : 1) * ctx.prefactor[n*n+n+m];
+          real_t c = 2 * n + 1, d = n + m, inv = real_t(1) / (n - m + 1);
+          real_t a = n - m + 1, e = n + 1;
+          if (NRHS == 1) {
+            real_t Lr = w * std::real(Ci->L[nms]), Li = w * std::imag(Ci->L[nms]);
+#pragma omp simd
+            for (int b=0; b<nb; b++) {
+              real_t LYr = rhon[b] * (Lr * er[b] - Li * ei[b]);
+              real_t LYi = rhon[b] * (Lr * ei[b] + Li * er[b]);
+              pot[0][b] += LYr * p[b];
+              s0[0][b] += LYr * p[b] * n;
+              s2[0][b] -= LYi * p[b] * m;
+              real_t p2 = p1[b];
+              p1[b] = p[b];
+              p[b] = (x[b] * c * p1[b] - d * p2) * inv;
+              s1[0][b] += LYr * (a * p[b] - e * x[b] * p1[b]);
+              rhon[b] *= r[b];
+            }
+            continue;
+          }
+#pragma omp simd
+          for (int b=0; b<nb; b++) {
+            Yr[b] = rhon[b] * er[b];
+            Yi[b] = rhon[b] * ei[b];
+            Yp[b] = p[b];
+            real_t p2 = p1[b];
+            p1[b] = p[b];
+            p[b] = (x[b] * c * p1[b] - d * p2) * inv;
+            Yt[b] = a * p[b] - e * x[b] * p1[b];
+            rhon[b] *= r[b];
+          }
+          for (int k=0; k<NRHS; k++) {
+            real_t Lr = w * std::real(Ci->L[k*ctx.NTERM+nms]), Li = w * std::imag(Ci->L[k*ctx.NTERM+nms]);
+#pragma omp simd
+            for (int b=0; b<nb; b++) {
+              real_t LYr = Lr * Yr[b] - Li * Yi[b];
+              real_t LYi = Lr * Yi[b] + Li * Yr[b];
+              pot[k][b] += LYr * Yp[b];
+              s0[k][b] += LYr * Yp[b] * n;
+              s2[k][b] -= LYi * Yp[b] * m;
+              s1[k][b] += LYr * Yt[b];
+            }
+          }
+        }
+#pragma omp simd
+        for (int b=0; b<nb; b++) {
+          pn[b] = -pn[b] * (2 * m + 1) * y[b];
+          rhom[b] *= r[b];
+          real_t e = er[b] * cb[b] - ei[b] * sb[b];
+          ei[b] = ei[b] * cb[b] + er[b] * sb[b];
+          er[b] = e;
+        }
+      }
+      for (int b=0; b<nb; b++) {
+        Body * B = Ci->BODY + b0 + b;
+        real_t invR = 1 / r[b];
+        for (int k=0; k<NRHS; k++) {
+          real_t sr = s0[k][b] * invR;
+          real_t st = s1[k][b] / y[b] * invR;
+          real_t sp = s2[k][b] * invR / y[b];
+          real_t * F = force(ctx, *B, k);
+          potential(ctx, *B, k) += pot[k][b];
+          F[0] += y[b] * cb[b] * sr + x[b] * cb[b] * st - sb[b] * sp;
+          F[1] += y[b] * sb[b] * sr + x[b] * sb[b] * st + cb[b] * sp;
+          F[2] += x[b] * sr - y[b] * st;
         }
       }
-      sph2cart(r, theta, phi, spherical, cartesian);
-      B->F[0] += cartesian[0];
-      B->F[1] += cartesian[1];
-      B->F[2] += cartesian[2];
     }
   }
+
+  void L2P(Context & ctx, Cell * Ci) {
+    EXAFMM_PROFILE_BEGIN;
+    EXAFMM_DISPATCH_RHS(L2P, ctx, Ci);
+    EXAFMM_PROFILE_END(ctx, kernelL2P, Ci->LEVEL, Ci->NBODY, uint64_t(Ci->NBODY) * (12 + 12 * ctx.NRHS) * ctx.P * ctx.P);
+  }
 }
 #endif
@@ -0,0 +1,225 @@
+#ifndef local_essential_tree_h
+#define local_essential_tree_h
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <mpi.h>
+#include "partition.h"
+#include "traversal.h"
+#include "types.h"
+
+namespace exafmm {
+  //! Cell of a local essential tree as it is sent between ranks
+  struct LETCell {
+    int NCHILD;                                                 //!< Number of child cells sent, 0 if the subtree is pruned
+    int ICHILD;                                                 //!< Index of first child in the tree of the sender
+    int NBODY;                                                  //!< Number of descendant bodies
+    int NSRC;                                                   //!< Length of SRC sent, 0 if the bodies are not needed
+    int LEVEL;                                                  //!< Level of cell, 0 for the root
+    real_t X[3];                                                //!< Cell center
+    real_t R;                                                   //!< Cell radius
+  };
+
+  //! Region of the target cells of a rank
+  struct Domain {
+    real_t Xmin[3];                                             //!< Lower corner of the bounding box of bodies
+    real_t Xmax[3];                                             //!< Upper corner of the bounding box of bodies
+    real_t Rleaf;                                               //!< Largest radius of a leaf cell
+  };
+
+  //! Statistics of the communication of one rank
+  struct CommStats {
+    double partitionTime;                                       //!< Seconds in partition()
+    double partitionBytes;                                      //!< Bytes of bodies sent
+    double letTime;                                             //!< Seconds in exchangeLET()
+    double letBytes;                                            //!< Bytes of cells, coefs and sources sent
+    double letCells;                                            //!< Number of cells received
+  };
+
+  //! Bounding box of local bodies and largest leaf radius of every rank
+  void getDomains(Bodies & bodies, Cells & cells, std::vector<Domain> & domains) {
+    Domain local;                                               // Domain of this rank
+    for (int d=0; d<3; d++) {                                   // Loop over dimensions
+      local.Xmin[d] = DBL_MAX;                                  //  Empty rank has an empty box
+      local.Xmax[d] = -DBL_MAX;                                 //  Empty rank has an empty box
+    }                                                           // End loop over dimensions
+    for (size_t b=0; b<bodies.size(); b++) {                    // Loop over bodies
+      for (int d=0; d<3; d++) local.Xmin[d] = fmin(bodies[b].X[d], local.Xmin[d]);// Update Xmin
+      for (int d=0; d<3; d++) local.Xmax[d] = fmax(bodies[b].X[d], local.Xmax[d]);// Update Xmax
+    }                                                           // End loop over bodies
+    local.Rleaf = 0;                                            // Largest leaf radius
+    for (size_t c=0; c<cells.size(); c++) {                     // Loop over cells
+      if (cells[c].NCHILD == 0) local.Rleaf = fmax(cells[c].R, local.Rleaf);// Update largest leaf radius
+    }                                                           // End loop over cells
+    domains.resize(mpisize);                                    // One domain per rank
+    MPI_Allgather(&local, sizeof(Domain), MPI_BYTE, domains.data(), sizeof(Domain), MPI_BYTE, MPI_COMM_WORLD);// Exchange domains
+  }
+
+  //! Distance from a point to the bounding box of a domain, 0 inside the box
+  real_t getDistance(const real_t * X, const Domain & D) {
+    real_t R2 = 0;                                              // Squared distance
+    for (int d=0; d<3; d++) {                                   // Loop over dimensions
+      real_t dX = std::max(D.Xmin[d] - X[d], X[d] - D.Xmax[d]); //  Distance outside the box
+      if (dX > 0) R2 += dX * dX;                                //  Accumulate if outside
+    }                                                           // End loop over dimensions
+    return std::sqrt(R2);                                       // Distance
+  }
+
+  /**
+   * @brief Whether dualTreeTraversal() of a target in the domain can split the source cell C
+   *
+   * @details C is split only when the pair fails the acceptance criterion and the
+   * target Ci is a leaf or smaller than C, so Ci->R is at most the larger of
+   * C->R and D.Rleaf. Ci holds a body of the domain within sqrt(3) Ci->R of its
+   * center, which bounds the distance of the centers from below.
+   */
+  bool needChildren(const Context & ctx, const Cell * C, const Domain & D) {
+    real_t Ri = std::max(C->R, D.Rleaf);                        // Largest target that can split C
+    return getDistance(C->X, D) * ctx.theta <= C->R + Ri * (1 + std::sqrt(real_t(3)) * ctx.theta);
+  }
+
+  //! Whether a leaf target in the domain can have a P2P pair with the leaf C
+  bool needBodies(const Context & ctx, const Cell * C, const Domain & D) {
+    return getDistance(C->X, D) * ctx.theta <= C->R + D.Rleaf * (1 + std::sqrt(real_t(3)) * ctx.theta);
+  }
+
+  /**
+   * @brief Append the local essential tree for one remote domain to send buffers
+   *
+   * @details Cells are visited breadth first from the root, so the children of
+   * a cell are contiguous as in buildTree(). Every visited cell is sent with its
+   * multipole. Its children are visited only if a target of the domain can
+   * split it, and the sources of a leaf are sent only if a target can have a
+   * P2P pair with it. Anywhere else the remote traversal accepts the pair.
+   *
+   * @param ctx Context with theta, NTERM, and NRHS
+   * @param C0 Root of local tree
+   * @param D Domain of the remote rank
+   * @param sendCells Cells, appended to
+   * @param sendCoefs Multipole coefs, NTERM * NRHS per cell, appended to
+   * @param sendSRC Packed sources of leafs, appended to
+   */
+  void packLET(const Context & ctx, Cell * C0, const Domain & D, std::vector<LETCell> & sendCells,
+               std::vector<coef_t> & sendCoefs, std::vector<p2p_t> & sendSRC) {
+    std::vector<Cell *> queue(1, C0);                           // Cells to send in breadth first order
+    for (size_t i=0; i<queue.size(); i++) {                     // Loop over queue
+      Cell * C = queue[i];                                      //  Current cell
+      LETCell c;                                                //  Cell to send
+      c.NCHILD = 0;                                             //  Pruned unless children are needed
+      c.ICHILD = 0;                                             //  No children
+      c.NBODY = C->NBODY;                                       //  Number of descendant bodies
+      c.NSRC = 0;                                               //  No sources unless bodies are needed
+      c.LEVEL = C->LEVEL;                                       //  Level of cell
+      for (int d=0; d<3; d++) c.X[d] = C->X[d];                 //  Cell center
+      c.R = C->R;                                               //  Cell radius
+      if (C->NCHILD != 0 && needChildren(ctx, C, D)) {          //  If children can be split
+        c.NCHILD = C->NCHILD;                                   //   Send all children
+        c.ICHILD = queue.size();                                //   They follow the queue
+        for (int j=0; j<C->NCHILD; j++) queue.push_back(C->CHILD + j);// Queue children
+      } else if (C->NCHILD == 0 && needBodies(ctx, C, D)) {     //  Else if leaf bodies are needed
+        c.NSRC = C->SRC.size();                                 //   Send packed sources
+        sendSRC.insert(sendSRC.end(), C->SRC.begin(), C->SRC.end());// Append sources
+      }                                                         //  End if for children and bodies
+      sendCells.push_back(c);                                   //  Append cell
+      sendCoefs.insert(sendCoefs.end(), C->M, C->M + ctx.NTERM * ctx.NRHS);// Append multipole coefs
+    }                                                           // End loop over queue
+  }
+
+  //! Rebuild a source tree from received cells, coefs and sources
+  void unpackLET(const Context & ctx, const LETCell * recvCells, int ncells, const coef_t * recvCoefs,
+                 const p2p_t * recvSRC, Tree & let) {
+    Cells & cells = let.cells;                                  // Cells of imported tree
+    cells.resize(ncells);                                       // Allocate cells
+    let.coefs.assign(recvCoefs, recvCoefs + ncells * ctx.NTERM * ctx.NRHS);// Multipole coefs
+    for (int c=0; c<ncells; c++) {                              // Loop over cells
+      const LETCell & l = recvCells[c];                         //  Received cell
+      cells[c].NCHILD = l.NCHILD;                               //  Number of child cells
+      cells[c].NBODY = l.NBODY;                                 //  Number of descendant bodies
+      cells[c].LEVEL = l.LEVEL;                                 //  Level of cell
+      cells[c].CHILD = cells.data() + l.ICHILD;                 //  Pointer of first child
+      cells[c].BODY = NULL;                                     //  Bodies stay on the sender
+      for (int d=0; d<3; d++) cells[c].X[d] = l.X[d];           //  Cell center
+      cells[c].R = l.R;                                         //  Cell radius
+      cells[c].M = &let.coefs[c * ctx.NTERM * ctx.NRHS];        //  Multipole coefs
+      cells[c].L = NULL;                                        //  Sources have no local coefs
+      cells[c].SRC.assign(recvSRC, recvSRC + l.NSRC);           //  Packed sources of leaf
+      recvSRC += l.NSRC;                                        //  Next sources
+    }                                                           // End loop over cells
+  }
+
+  //! Alltoallv of a vector in bytes, with counts in elements
+  template<typename T>
+  void alltoallv(std::vector<T> & send, std::vector<int> & sendCount,
+                 std::vector<T> & recv, std::vector<int> & recvCount, double & bytes) {
+    MPI_Alltoall(sendCount.data(), 1, MPI_INT, recvCount.data(), 1, MPI_INT, MPI_COMM_WORLD);// Exchange counts
+    std::vector<int> sendBytes(mpisize), recvBytes(mpisize);    // Counts in bytes
+    std::vector<int> sendDispl(mpisize, 0), recvDispl(mpisize, 0);// Offsets in bytes
+    for (int i=0; i<mpisize; i++) {                             // Loop over ranks
+      sendBytes[i] = sendCount[i] * sizeof(T);                  //  Send count in bytes
+      recvBytes[i] = recvCount[i] * sizeof(T);                  //  Receive count in bytes
+      if (i != mpirank) bytes += sendBytes[i];                  //  Bytes sent to other ranks
+    }                                                           // End loop over ranks
+    for (int i=1; i<mpisize; i++) {                             // Loop over ranks
+      sendDispl[i] = sendDispl[i-1] + sendBytes[i-1];           //  Scan send counts
+      recvDispl[i] = recvDispl[i-1] + recvBytes[i-1];           //  Scan receive counts
+    }                                                           // End loop over ranks
+    recv.resize((recvDispl[mpisize-1] + recvBytes[mpisize-1]) / sizeof(T));// Allocate receive buffer
+    MPI_Alltoallv(send.data(), sendBytes.data(), sendDispl.data(), MPI_BYTE,
+                  recv.data(), recvBytes.data(), recvDispl.data(), MPI_BYTE, MPI_COMM_WORLD);// Exchange data
+  }
+
+  /**
+   * @brief Exchange local essential trees between all ranks
+   *
+   * @details Must follow upwardPass(), which packs the sources and computes the
+   * multipoles of the local tree. lets[i] is the part of the tree of rank i
+   * that the local targets need, and traversal(ctx, cells, lets[i].cells) adds the
+   * field of the bodies of rank i. lets[mpirank] stays empty. Free space only.
+   *
+   * @param ctx Context with theta, NTERM, and NRHS
+   * @param bodies Local bodies
+   * @param cells Local cells
+   * @param lets Imported trees of each rank
+   * @param stats Bytes sent and number of cells received, added to
+   */
+  void exchangeLET(Context & ctx, Bodies & bodies, Cells & cells, std::vector<Tree> & lets, CommStats & stats) {
+    std::vector<Domain> domains;                                // Domains of all ranks
+    getDomains(bodies, cells, domains);                         // Exchange domains
+    std::vector<LETCell> sendCells, recvCells;                  // Cells to and from each rank
+    std::vector<coef_t> sendCoefs, recvCoefs;                   // Coefs to and from each rank
+    std::vector<p2p_t> sendSRC, recvSRC;                        // Sources to and from each rank
+    std::vector<int> cellCount(mpisize, 0), coefCount(mpisize, 0), srcCount(mpisize, 0);// Send counts
+    for (int i=0; i<mpisize; i++) {                             // Loop over ranks
+      if (i == mpirank) continue;                               //  Skip self
+      size_t ncells = sendCells.size(), nsrc = sendSRC.size();  //  Sizes before this rank
+      packLET(ctx, &cells[0], domains[i], sendCells, sendCoefs, sendSRC);// Tree for rank i
+      cellCount[i] = sendCells.size() - ncells;                 //  Number of cells
+      coefCount[i] = cellCount[i] * ctx.NTERM * ctx.NRHS;       //  Number of coefs
+      srcCount[i] = sendSRC.size() - nsrc;                      //  Number of sources
+    }                                                           // End loop over ranks
+    std::vector<int> recvCellCount(mpisize), recvCoefCount(mpisize), recvSrcCount(mpisize);// Receive counts
+    alltoallv(sendCells, cellCount, recvCells, recvCellCount, stats.letBytes);// Exchange cells
+    alltoallv(sendCoefs, coefCount, recvCoefs, recvCoefCount, stats.letBytes);// Exchange coefs
+    alltoallv(sendSRC, srcCount, recvSRC, recvSrcCount, stats.letBytes);// Exchange sources
+    lets.resize(mpisize);                                       // One imported tree per rank
+    int icell = 0, isrc = 0;                                    // Offsets in receive buffers
+    for (int i=0; i<mpisize; i++) {                             // Loop over ranks
+      lets[i].cells.clear();                                    //  Clear previous tree
+      if (recvCellCount[i] == 0) continue;                      //  Nothing from self
+      unpackLET(ctx, recvCells.data() + icell, recvCellCount[i], recvCoefs.data() + icell * ctx.NTERM * ctx.NRHS,
+                recvSRC.data() + isrc, lets[i]);                //  Tree of rank i
+      icell += recvCellCount[i];                                //  Next cells
+      isrc += recvSrcCount[i];                                  //  Next sources
+    }                                                           // End loop over ranks
+    stats.letCells += icell;                                    // Number of cells received
+  }
+
+  //! Traversal of the local targets with the local tree and all imported trees
+  void traversalLET(Context & ctx, Cells & cells, std::vector<Tree> & lets) {
+    traversal(ctx, cells, cells);                               // Local sources
+    for (size_t i=0; i<lets.size(); i++) {                      // Loop over ranks
+      if (!lets[i].cells.empty()) traversal(ctx, cells, lets[i].cells);// Sources of rank i
+    }                                                           // End loop over ranks
+  }
+}
+#endif
@@ -0,0 +1,111 @@
+#ifndef partition_h
+#define partition_h
+#include <algorithm>
+#include <cfloat>
+#include <mpi.h>
+#include "build_tree.h"
+#include "types.h"
+
+namespace exafmm {
+  int mpirank;                                                  //!< Rank of this process
+  int mpisize;                                                  //!< Number of processes
+  const int partitionLevel = 6;                                 //!< Level of the cells that are assigned to ranks
+
+  //! Initialize rank and size of MPI_COMM_WORLD
+  void initMPI(int * argc, char *** argv) {
+    int provided;                                               // Thread support of the MPI library
+    MPI_Init_thread(argc, argv, MPI_THREAD_FUNNELED, &provided);// Only the master thread calls MPI
+    MPI_Comm_rank(MPI_COMM_WORLD, &mpirank);                    // Rank of this process
+    MPI_Comm_size(MPI_COMM_WORLD, &mpisize);                    // Number of processes
+  }
+
+  /**
+   * @brief Get bounding box of the bodies of all ranks
+   *
+   * @details Every rank gets the same root box, so the cells of all local trees
+   * lie on one lattice, as for buildTrees(). With cycle > 0 the root cell is the
+   * periodic box.
+   *
+   * @param ctx Context with cycle
+   * @param bodies Local bodies, possibly empty
+   * @param R0 Radius of the global bounding box
+   * @param X0 Center of the global bounding box
+   */
+  void getGlobalBounds(Context & ctx, Bodies & bodies, real_t & R0, real_t * X0) {
+    if (ctx.cycle > 0) {                                        // If periodic
+      R0 = ctx.cycle / 2;                                       //  Root cell is the periodic box
+      for (int d=0; d<3; d++) X0[d] = 0;                        //  Centered at the origin
+      return;                                                   //  Done
+    }                                                           // End if for periodic
+    real_t Xmin[3], Xmax[3];                                    // Local min, max of domain
+    for (int d=0; d<3; d++) {                                   // Loop over dimensions
+      Xmin[d] = DBL_MAX;                                        //  Empty rank does not lower max
+      Xmax[d] = -DBL_MAX;                                       //  Empty rank does not raise min
+    }                                                           // End loop over dimensions
+    for (size_t b=0; b<bodies.size(); b++) {                    // Loop over bodies
+      for (int d=0; d<3; d++) Xmin[d] = fmin(bodies[b].X[d], Xmin[d]);// Update Xmin
+      for (int d=0; d<3; d++) Xmax[d] = fmax(bodies[b].X[d], Xmax[d]);// Update Xmax
+    }                                                           // End loop over bodies
+    Bodies corners(2);                                          // Corners of the global box
+    MPI_Allreduce(Xmin, corners[0].X, 3, MPI_DOUBLE, MPI_MIN, MPI_COMM_WORLD);// Global lower corner
+    MPI_Allreduce(Xmax, corners[1].X, 3, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);// Global upper corner
+    getBounds(corners, R0, X0);                                 // Same center and leeway as buildTree()
+  }
+
+  /**
+   * @brief Partition bodies over ranks in Morton order
+   *
+   * @details Bodies are counted per cell of partitionLevel of the global root,
+   * and the counts are summed over ranks. Each rank then gets a contiguous range
+   * of these cells in Morton order with an equal share of bodies, and the
+   * bodies are sent to their owners with MPI_Alltoallv. The domain of a rank is
+   * a union of whole cells, which keeps it compact.
+   *
+   * @param bodies Local bodies, replaced by the bodies owned by this rank
+   * @param X0 Center of the global root cell
+   * @param R0 Radius of the global root cell
+   * @param bytes Number of bytes sent by this rank, added to
+   */
+  void partition(Bodies & bodies, real_t * X0, real_t R0, double & bytes) {
+    const int nbin = 1 << (3 * partitionLevel);                 // Number of cells at partitionLevel
+    const int shift = 3 * (maxLevel - partitionLevel);          // Bits of a key below partitionLevel
+    std::vector<int> bins(bodies.size());                       // Cell of each body
+    std::vector<long long> count(nbin, 0), total(nbin);         // Local and global bodies per cell
+    for (size_t b=0; b<bodies.size(); b++) {                    // Loop over bodies
+      bins[b] = mortonKey(bodies[b].X, X0, R0) >> shift;        //  Cell at partitionLevel
+      count[bins[b]]++;                                         //  Count body
+    }                                                           // End loop over bodies
+    MPI_Allreduce(count.data(), total.data(), nbin, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);// Global counts
+    std::vector<int> owner(nbin);                               // Rank of each cell
+    long long numBodies = 0;                                    // Global number of bodies
+    for (int i=0; i<nbin; i++) numBodies += total[i];           // Sum counts
+    long long sum = 0;                                          // Bodies in cells before this one
+    for (int i=0; i<nbin; i++) {                                // Loop over cells in Morton order
+      owner[i] = std::min(int(sum * mpisize / std::max(numBodies, 1LL)), mpisize - 1);// Rank of first body
+      sum += total[i];                                          //  Scan counts
+    }                                                           // End loop over cells
+    std::vector<int> sendCount(mpisize, 0), recvCount(mpisize); // Number of bodies sent to each rank
+    for (size_t b=0; b<bodies.size(); b++) sendCount[owner[bins[b]]]++;// Count bodies per owner
+    MPI_Alltoall(sendCount.data(), 1, MPI_INT, recvCount.data(), 1, MPI_INT, MPI_COMM_WORLD);// Exchange counts
+    std::vector<int> sendDispl(mpisize+1, 0), recvDispl(mpisize+1, 0);// Offsets of each rank
+    for (int i=0; i<mpisize; i++) {                             // Loop over ranks
+      sendDispl[i+1] = sendDispl[i] + sendCount[i];             //  Scan send counts
+      recvDispl[i+1] = recvDispl[i] + recvCount[i];             //  Scan receive counts
+    }                                                           // End loop over ranks
+    Bodies sendBodies(bodies.size());                           // Bodies grouped by owner
+    std::vector<int> offset(sendDispl.begin(), sendDispl.end()-1);// Next slot of each owner
+    for (size_t b=0; b<bodies.size(); b++) sendBodies[offset[owner[bins[b]]]++] = bodies[b];// Group by owner
+    bodies.resize(recvDispl[mpisize]);                          // Bodies owned by this rank
+    const int size = sizeof(Body);                              // Bodies are sent as bytes
+    for (int i=0; i<mpisize; i++) {                             // Loop over ranks
+      sendCount[i] *= size;                                     //  Count in bytes
+      recvCount[i] *= size;                                     //  Count in bytes
+      sendDispl[i] *= size;                                     //  Offset in bytes
+      recvDispl[i] *= size;                                     //  Offset in bytes
+    }                                                           // End loop over ranks
+    MPI_Alltoallv(sendBodies.data(), sendCount.data(), sendDispl.data(), MPI_BYTE,
+                  bodies.data(), recvCount.data(), recvDispl.data(), MPI_BYTE, MPI_COMM_WORLD);// Send bodies
+    bytes += double(sendDispl[mpisize-1] + sendCount[mpisize-1] - sendCount[mpirank]);// Bytes sent to other ranks
+  }
+}
+#endif
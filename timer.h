@@ -1,7 +1,22 @@
 #ifndef timer_h
 #define timer_h
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
 #include <map>
+#include <omp.h>
+#include <stdint.h>
+#include <string>
 #include <sys/time.h>
+#include <time.h>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#ifndef EXAFMM_PROFILE
+#define EXAFMM_PROFILE 0
+#endif
 
 namespace exafmm {
   timeval t;                                                    //!< Time value
@@ -19,5 +34,137 @@ namespace exafmm {
     printf("%-20s : %f s\n", event.c_str(), t.tv_sec-timer[event].tv_sec+
            (t.tv_usec-timer[event].tv_usec)*1e-6);              // Print time difference
   }
+
+  //! Kernels counted by the profiler
+  enum Kernel { kernelP2M, kernelM2M, kernelM2L, kernelL2L, kernelL2P, kernelP2P, numKernels };
+  const char * kernelNames[numKernels] = {"P2M", "M2M", "M2L", "L2L", "L2P", "P2P"};//!< Names of kernels
+  const int profileLevels = 32;                                 //!< Levels counted separately, deeper ones go to the last
+
+  //! Counters of one kernel at one level of one thread
+  struct Counter {
+    uint64_t calls;                                             //!< Number of kernel calls
+    uint64_t interactions;                                      //!< Number of bodies, cells, or body pairs
+    uint64_t flops;                                             //!< Estimated floating point operations
+    uint64_t ticks;                                             //!< Cycles from rdtsc, or nanoseconds
+  };
+
+  //! Cycle counter, or monotonic nanoseconds where there is no rdtsc
+  inline uint64_t readTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+  }
+
+  //! Clear the counters of all threads
+  void resetProfile(std::vector<Counter> & counters) {
+    counters.assign(omp_get_max_threads()*numKernels*profileLevels, Counter());
+  }
+
+  //! Add zero counters for threads beyond those counted so far, keeping the counts
+  void reserveProfile(std::vector<Counter> & counters) {
+    size_t n = size_t(omp_get_max_threads())*numKernels*profileLevels;// Counters of the next parallel region
+    if (counters.size() < n) counters.resize(n, Counter());     // Grow for a larger team
+  }
+
+  /**
+   * @brief Add one kernel call to the counters of the calling thread
+   *
+   * @details Each thread owns a contiguous block of counters, so no atomics are
+   * needed. The passes and the traversal call reserveProfile() before their
+   * parallel regions, so a team that grew after initKernel() has counters too.
+   * A call from a thread that still has none is dropped.
+   *
+   * @param counters Counters of each thread, kernel, and level
+   * @param kernel Kernel that was called
+   * @param level Level of the target cell, or the parent for M2M and L2L
+   * @param interactions Number of bodies, cells, or body pairs
+   * @param flops Estimated floating point operations
+   * @param ticks Ticks spent in the call
+   */
+  inline void profile(std::vector<Counter> & counters, Kernel kernel, int level, uint64_t interactions,
+                      uint64_t flops, uint64_t ticks) {
+    level = std::min(std::max(level, 0), profileLevels-1);      // Clamp level
+    size_t i = (size_t(omp_get_thread_num())*numKernels+kernel)*profileLevels+level;// Index of counter
+    assert(i < counters.size());                                // Team larger than reserved
+    if (i >= counters.size()) return;                           // Drop call without a counter
+    Counter & c = counters[i];                                  // Counter of thread, kernel, and level
+    c.calls++;                                                  // Count call
+    c.interactions += interactions;                             // Count interactions
+    c.flops += flops;                                           // Count flops
+    c.ticks += ticks;                                           // Count ticks
+  }
+
+  /**
+   * @brief Write the counters as JSON
+   *
+   * @details "kernels" holds the counters of each kernel and level, merged over
+   * threads. "threads" holds the counters of each thread and kernel, merged over
+   * levels, to show load imbalance. Zero counters are omitted.
+   *
+   * @param counters Counters of each thread, kernel, and level
+   * @param filename Output file
+   */
+  void writeProfile(const std::vector<Counter> & counters, const char * filename) {
+    FILE * file = fopen(filename, "w");                         // Open file
+    if (!file) return;                                          // Skip if not writable
+    int nthreads = counters.size() / (numKernels * profileLevels);// Number of threads
+    const char * unit = "cycles";                               // Unit of ticks
+#if !defined(__x86_64__) && !defined(__i386__)
+    unit = "ns";                                                // Nanoseconds from clock_gettime
+#endif
+    fprintf(file, "{\n  \"ticks\": \"%s\",\n  \"kernels\": [", unit);// Header
+    const char * separator = "\n";                              // Separator between records
+    for (int k=0; k<numKernels; k++) {                          // Loop over kernels
+      for (int l=0; l<profileLevels; l++) {                     //  Loop over levels
+        Counter s = Counter();                                  //   Merged counters
+        for (int i=0; i<nthreads; i++) {                        //   Loop over threads
+          const Counter & c = counters[(i*numKernels+k)*profileLevels+l];
+          s.calls += c.calls;                                   //    Merge calls
+          s.interactions += c.interactions;                     //    Merge interactions
+          s.flops += c.flops;                                   //    Merge flops
+          s.ticks += c.ticks;                                   //    Merge ticks
+        }                                                       //   End loop over threads
+        if (!s.calls) continue;                                 //   Skip unused counter
+        fprintf(file, "%s    {\"kernel\": \"%s\", \"level\": %d, \"calls\": %lu, \"interactions\": %lu, "
+                "\"flops\": %lu, \"ticks\": %lu}", separator, kernelNames[k], l, (unsigned long)s.calls,
+                (unsigned long)s.interactions, (unsigned long)s.flops, (unsigned long)s.ticks);
+        separator = ",\n";                                      //   Separate next record
+      }                                                         //  End loop over levels
+    }                                                           // End loop over kernels
+    fprintf(file, "\n  ],\n  \"threads\": [");                  // End of kernels
+    separator = "\n";                                           // Separator between records
+    for (int i=0; i<nthreads; i++) {                            // Loop over threads
+      for (int k=0; k<numKernels; k++) {                        //  Loop over kernels
+        Counter s = Counter();                                  //   Merged counters
+        for (int l=0; l<profileLevels; l++) {                   //   Loop over levels
+          const Counter & c = counters[(i*numKernels+k)*profileLevels+l];
+          s.calls += c.calls;                                   //    Merge calls
+          s.interactions += c.interactions;                     //    Merge interactions
+          s.flops += c.flops;                                   //    Merge flops
+          s.ticks += c.ticks;                                   //    Merge ticks
+        }                                                       //   End loop over levels
+        if (!s.calls) continue;                                 //   Skip unused counter
+        fprintf(file, "%s    {\"thread\": %d, \"kernel\": \"%s\", \"calls\": %lu, \"interactions\": %lu, "
+                "\"flops\": %lu, \"ticks\": %lu}", separator, i, kernelNames[k], (unsigned long)s.calls,
+                (unsigned long)s.interactions, (unsigned long)s.flops, (unsigned long)s.ticks);
+        separator = ",\n";                                      //   Separate next record
+      }                                                         //  End loop over kernels
+    }                                                           // End loop over threads
+    fprintf(file, "\n  ]\n}\n");                                // End of threads
+    fclose(file);                                               // Close file
+  }
 }
+
+#if EXAFMM_PROFILE
+#define EXAFMM_PROFILE_BEGIN uint64_t profileTicks = exafmm::readTicks()
+#define EXAFMM_PROFILE_END(ctx, kernel, level, interactions, flops) \
+  exafmm::profile((ctx).counters, kernel, level, interactions, flops, exafmm::readTicks() - profileTicks)
+#else
+#define EXAFMM_PROFILE_BEGIN
+#define EXAFMM_PROFILE_END(ctx, kernel, level, interactions, flops)
+#endif
 #endif
@@ -1,60 +1,554 @@
 #ifndef traversal_h
 #define traversal_h
+#include <algorithm>
+#include <cmath>
+#include <omp.h>
+#include "kernel.h"
 #include "types.h"
 
 namespace exafmm {
-  int images;                                                   //!< Number of periodic image sublevels
-  real_t theta;                                                 //!< Multipole acceptance criteria
-
-  //! Post-order traversal for upward pass
-  void upwardPass(Cell * Ci) {
-    for (Cell * Cj=Ci->CHILD; Cj!=Ci->CHILD+Ci->NCHILD; Cj++) { // Loop over child cells
-      upwardPass(Cj);                                           //  Recursive call for child cell
-    }                                                           // End loop over child cells
-    Ci->M.resize(NTERM, 0.0);                                   // Allocate and initialize multipole coefs
-    Ci->L.resize(NTERM, 0.0);                                   // Allocate and initialize local coefs
-    if(Ci->NCHILD==0) P2M(Ci);                                  // P2M kernel
-    M2M(Ci);                                                    // M2M kernel
-  }
-
-  //! Dual tree traversal for a single pair of cells
-  void traversal(Cell * Ci, Cell * Cj) {
-    for (int d=0; d<3; d++) dX[d] = Ci->X[d] - Cj->X[d] - Xperiodic[d];// Distance vector from source to target
-    real_t R2 = (dX[0] * dX[0] + dX[1] * dX[1] + dX[2] * dX[2]) * theta * theta;// Scalar distance squared
+  /**
+   * @brief Upward pass, level by level
+   *
+   * @details All cells are cleared and all leafs run P2M in one parallel loop.
+   * M2M then runs for one level at a time from the bottom up, as a parallel loop
+   * over the cells of the level, and the barrier at the end of each loop makes
+   * the children complete before their parents read them. The level ranges are
+   * the ones buildTree() stored in the tree, so repeated passes over the same
+   * tree allocate nothing.
+   *
+   * @param ctx Context with the tables for P2M and M2M
+   * @param tree Tree from buildTree(), with M and L in its arena
+   */
+  void upwardPass(Context & ctx, Tree & tree) {
+    Cells & cells = tree.cells;                                 // Cells in level order
+    const std::vector<int> & levels = tree.levels;              // Index of first cell of each level
+    int ncells = cells.size();                                  // Number of cells
+    reserveProfile(ctx.counters);                               // Counters for every thread of the team
+#pragma omp parallel                                            // Open thread team
+    {
+#pragma omp for schedule(dynamic)
+      for (int c=0; c<ncells; c++) {                            //  Loop over cells
+        Cell * C = &cells[c];                                   //   Cell
+        std::fill(C->M, C->M+ctx.NTERM*ctx.NRHS, coef_t(0));    //   Initialize multipole coefs
+        std::fill(C->L, C->L+ctx.NTERM*ctx.NRHS, coef_t(0));    //   Initialize local coefs
+        if (C->NCHILD == 0) {                                   //   If leaf cell
+          packSources(ctx, C);                                  //    SoA copy of bodies for P2P
+          P2M(ctx, C);                                          //    P2M kernel
+        }                                                       //   End if for leaf cell
+      }                                                         //  End loop over cells
+      for (int level=levels.size()-2; level>=0; level--) {      //  Loop over levels bottom up
+#pragma omp for schedule(dynamic)
+        for (int c=levels[level]; c<levels[level+1]; c++) {     //   Loop over cells at this level
+          if (cells[c].NCHILD != 0) M2M(ctx, &cells[c]);        //    M2M kernel
+        }                                                       //   End loop over cells at this level
+      }                                                         //  End loop over levels
+    }                                                           // End parallel region
+  }
+
+  /**
+   * @brief Clear local coefs of a target tree that has no upward pass
+   *
+   * @details With separate trees, upwardPass() runs on the source tree only, and
+   * this replaces it on the target tree, which needs no P2M or M2M.
+   *
+   * @param ctx Context with NTERM and NRHS
+   * @param cells Target cells
+   */
+  void initLocal(Context & ctx, Cells & cells) {
+#pragma omp parallel for
+    for (int c=0; c<int(cells.size()); c++) {                   // Loop over cells
+      std::fill(cells[c].L, cells[c].L+ctx.NTERM*ctx.NRHS, coef_t(0));//  Initialize local coefs
+    }                                                           // End loop over cells
+  }
+
+  /**
+   * @brief Recursive call to dual tree traversal for a single pair of cells
+   *
+   * @details Tasks are only spawned when splitting the target cell Ci, and the
+   * parent waits for them before returning. Each task therefore owns a disjoint
+   * target subtree, so M2L and P2P can accumulate into Ci->L and Ci->BODY
+   * without atomics. Splitting the source cell Cj stays in the current task.
+   *
+   * @param ctx Context with theta, nspawn, and the tables for M2L
+   * @param Ci Target cell
+   * @param Cj Source cell
+   * @param useList Record the pair in the interaction lists of Ci instead of evaluating it
+   */
+  void dualTreeTraversal(Context & ctx, Cell * Ci, Cell * Cj, bool useList=false) {
+    real_t dX[3];                                               // Distance vector
+    for (int d=0; d<3; d++) dX[d] = Ci->X[d] - Cj->X[d] - ctx.Xperiodic[d];// Distance vector from source to target
+    real_t R2 = (dX[0] * dX[0] + dX[1] * dX[1] + dX[2] * dX[2]) * ctx.theta * ctx.theta;// Scalar distance squared
     if (R2 > (Ci->R + Cj->R) * (Ci->R + Cj->R)) {               // If distance is far enough
-      M2L(Ci, Cj);                                              //  M2L kernel
+      if (useList) Ci->listM2L.push_back(Cj);                   //  Record M2L interaction
+      else M2L(ctx, Ci, Cj);                                    //  M2L kernel
+    } else if (Ci->NCHILD == 0 && Cj->NCHILD == 0) {            // Else if both cells are leafs
+      if (useList) Ci->listP2P.push_back(Cj);                   //  Record P2P interaction
+      else P2P(ctx, Ci, Cj);                                    //  P2P kernel
+    } else if (Cj->NCHILD == 0 || (Ci->NCHILD != 0 && Ci->R >= Cj->R)) {// If Cj is leaf or Ci is larger
+      for (Cell * ci=Ci->CHILD; ci!=Ci->CHILD+Ci->NCHILD; ci++) {// Loop over Ci's children
+#pragma omp task untied shared(ctx) if(ci->NBODY > ctx.nspawn)  //   Spawn task only for large subtrees
+        dualTreeTraversal(ctx, ci, Cj, useList);                //   Traverse a single pair of cells
+      }                                                         //  End loop over Ci's children
+#pragma omp taskwait                                            //  Keep target subtrees owned by one task
+    } else {                                                    // Else if Ci is leaf or Cj is larger
+      for (Cell * cj=Cj->CHILD; cj!=Cj->CHILD+Cj->NCHILD; cj++) {// Loop over Cj's children
+        dualTreeTraversal(ctx, Ci, cj, useList);                //   Traverse a single pair of cells
+      }                                                         //  End loop over Cj's children
+    }                                                           // End if for leafs and Ci Cj size
+  }
+
+  //! Multipole acceptance criterion of a free space pair of cells
+  bool isFar(const Context & ctx, const Cell * Ci, const Cell * Cj) {
+    real_t dX[3];                                               // Distance vector
+    for (int d=0; d<3; d++) dX[d] = Ci->X[d] - Cj->X[d];        // Distance vector from Cj to Ci
+    real_t R2 = (dX[0] * dX[0] + dX[1] * dX[1] + dX[2] * dX[2]) * ctx.theta * ctx.theta;// Scalar distance squared
+    return R2 > (Ci->R + Cj->R) * (Ci->R + Cj->R);              // Distance is far enough
+  }
+
+  void mutualTraversal(Context & ctx, Cell * Ci, Cell * Cj);
+
+  /**
+   * @brief Mutual traversal of all pairs of two sets of disjoint cells, in rounds of disjoint pairs
+   *
+   * @details Round r pairs ci[a] with cj[(a + r) % max(n, m)], so no cell is in
+   * two pairs of a round. Each pair is a task that owns both of its subtrees,
+   * and the taskwait after each round keeps the next round from touching them.
+   *
+   * @param ctx Context with nspawn
+   * @param ci First cells
+   * @param n Number of first cells
+   * @param cj Second cells, not overlapping any of ci
+   * @param m Number of second cells
+   */
+  void mutualRounds(Context & ctx, Cell ** ci, int n, Cell ** cj, int m) {
+    int nm = std::max(n, m);                                    // Number of rounds
+    for (int round=0; round<nm; round++) {                      // Loop over rounds
+      for (int a=0; a<n; a++) {                                 //  Loop over first cells
+        int b = (a + round) % nm;                               //   Second cell, shifted by the round
+        if (b >= m) continue;                                   //   First cell sits out this round
+#pragma omp task untied shared(ctx) if(ci[a]->NBODY + cj[b]->NBODY > ctx.nspawn)//   Spawn task only for large pairs
+        mutualTraversal(ctx, ci[a], cj[b]);                     //   Pairs of a round are disjoint
+      }                                                         //  End loop over first cells
+#pragma omp taskwait                                            //  Next round reuses the cells
+    }                                                           // End loop over rounds
+  }
+
+  /**
+   * @brief Recursive call to mutual traversal of two disjoint subtrees of one tree
+   *
+   * @details Every accepted pair updates both cells, so the task that calls this
+   * owns both subtrees. Splitting the larger cell alone would give pairs that
+   * all share the other cell, so a large pair is split two levels at once. The
+   * children of the larger cell that are accepted against the smaller cell, or
+   * that are split further themselves, are traversed first in this task, as the
+   * serial order would. The children that would split the smaller cell are then
+   * paired with its children by mutualRounds(), which gives the same pairs as
+   * the serial traversal.
+   *
+   * @param ctx Context with theta, nspawn, and the tables for M2Lmutual
+   * @param Ci First cell
+   * @param Cj Second cell, not overlapping Ci
+   */
+  void mutualTraversal(Context & ctx, Cell * Ci, Cell * Cj) {
+    bool spawn = Ci->NBODY + Cj->NBODY > ctx.nspawn;            // Large pair, split into tasks
+    Cell * split[8];                                            // Children that split the other cell
+    int nsplit = 0;                                             // Number of such children
+    if (isFar(ctx, Ci, Cj)) {                                   // If distance is far enough
+      M2Lmutual(ctx, Ci, Cj);                                   //  M2L kernel in both directions
     } else if (Ci->NCHILD == 0 && Cj->NCHILD == 0) {            // Else if both cells are leafs
-      P2P(Ci, Cj);                                              //  P2P kernel
-    } else if (Cj->NCHILD == 0 || Ci->R >= Cj->R) {             // If Cj is leaf or Ci is larger
+      P2Pmutual(ctx, Ci, Cj);                                   //  P2P kernel in both directions
+    } else if (Cj->NCHILD == 0 || (Ci->NCHILD != 0 && Ci->R >= Cj->R)) {// If Cj is leaf or Ci is larger
       for (Cell * ci=Ci->CHILD; ci!=Ci->CHILD+Ci->NCHILD; ci++) {// Loop over Ci's children
-        traversal(ci, Cj);                                      //   Traverse a single pair of cells
+        if (spawn && Cj->NCHILD != 0 && !isFar(ctx, ci, Cj) &&  //   If ci would split Cj
+            !(ci->NCHILD != 0 && ci->R >= Cj->R)) split[nsplit++] = ci;//    Defer to the rounds
+        else mutualTraversal(ctx, ci, Cj);                      //   Traverse a single pair of cells
       }                                                         //  End loop over Ci's children
+      if (nsplit) {                                             //  If pairs of children are left
+        Cell * cj[8];                                           //   Children of Cj
+        for (int j=0; j<Cj->NCHILD; j++) cj[j] = Cj->CHILD + j; //   Collect children of Cj
+        mutualRounds(ctx, split, nsplit, cj, Cj->NCHILD);       //   Pairs of children in tasks
+      }                                                         //  End if for pairs of children
     } else {                                                    // Else if Ci is leaf or Cj is larger
       for (Cell * cj=Cj->CHILD; cj!=Cj->CHILD+Cj->NCHILD; cj++) {// Loop over Cj's children
-        traversal(Ci, cj);                                      //   Traverse a single pair of cells
+        if (spawn && Ci->NCHILD != 0 && !isFar(ctx, Ci, cj) &&  //   If cj would split Ci
+            (cj->NCHILD == 0 || Ci->R >= cj->R)) split[nsplit++] = cj;//    Defer to the rounds
+        else mutualTraversal(ctx, Ci, cj);                      //   Traverse a single pair of cells
       }                                                         //  End loop over Cj's children
+      if (nsplit) {                                             //  If pairs of children are left
+        Cell * ci[8];                                           //   Children of Ci
+        for (int i=0; i<Ci->NCHILD; i++) ci[i] = Ci->CHILD + i; //   Collect children of Ci
+        mutualRounds(ctx, ci, Ci->NCHILD, split, nsplit);       //   Pairs of children in tasks
+      }                                                         //  End if for pairs of children
     }                                                           // End if for leafs and Ci Cj size
   }
 
-  //! Pre-order traversal for downward pass
-  void downwardPass(Cell * Cj) {
-    L2L(Cj);                                                    // L2L kernel
-    if (Cj->NCHILD==0) L2P(Cj);                                 // L2P kernel
-    for (Cell * Ci=Cj->CHILD; Ci!=Cj->CHILD+Cj->NCHILD; Ci++) { // Loop over child cells
-      downwardPass(Ci);                                         //  Recursive call for child cell
-    }                                                           // End loop over chlid cells
-  }
-
-  //! Direct summation
-  void direct(Bodies & bodies, Bodies & jbodies) {
-    Cells cells(2);                                             // Define a pair of cells to pass to P2P kernel
-    Cell * Ci = &cells[0];                                      // Allocate single target
-    Cell * Cj = &cells[1];                                      // Allocate single source
-    Ci->BODY = &bodies[0];                                      // Iterator of first target body
-    Ci->NBODY = bodies.size();                                  // Number of target bodies
-    Cj->BODY = &jbodies[0];                                     // Iterator of first source body
-    Cj->NBODY = jbodies.size();                                 // Number of source bodies
-    P2P(Ci, Cj);                                                // Evaluate P2P kenrel
+  /**
+   * @brief Recursive call to self interaction of a cell, visiting each pair once
+   *
+   * @details The children first interact with themselves, in tasks that own one
+   * child each. The pairs of different children are then scheduled as rounds of
+   * a round-robin tournament, where the pairs of one round are disjoint. A task
+   * per pair therefore owns both of its subtrees, and the taskwait after each
+   * round keeps the next round from touching them.
+   *
+   * @param ctx Context with nspawn
+   * @param C Cell
+   */
+  void selfTraversal(Context & ctx, Cell * C) {
+    if (C->NCHILD == 0) {                                       // If leaf cell
+      P2P(ctx, C, C);                                           //  P2P kernel of bodies in the leaf
+      return;                                                   //  Done
+    }                                                           // End if for leaf cell
+    for (Cell * c=C->CHILD; c!=C->CHILD+C->NCHILD; c++) {       // Loop over children
+#pragma omp task untied shared(ctx) if(c->NBODY > ctx.nspawn)   //  Spawn task only for large subtrees
+      selfTraversal(ctx, c);                                    //  Recursive call for child cell
+    }                                                           // End loop over children
+#pragma omp taskwait                                            // Children are owned by the rounds below
+    int n = C->NCHILD + C->NCHILD % 2;                          // Even number of players, with a bye
+    for (int round=0; round<n-1; round++) {                     // Loop over rounds
+      for (int k=0; k<n/2; k++) {                               //  Loop over pairs of round
+        int a = k ? (round + k) % (n - 1) : n - 1;              //   First child, the last one stays fixed
+        int b = (round + n - 1 - k) % (n - 1);                  //   Second child, rotated around the circle
+        if (a >= C->NCHILD || b >= C->NCHILD) continue;         //   Skip the bye
+        Cell * Ci = C->CHILD + a;                               //   First cell of pair
+        Cell * Cj = C->CHILD + b;                               //   Second cell of pair
+#pragma omp task untied shared(ctx) if(Ci->NBODY + Cj->NBODY > ctx.nspawn)//   Spawn task only for large pairs
+        mutualTraversal(ctx, Ci, Cj);                           //   Pairs of a round are disjoint
+      }                                                         //  End loop over pairs of round
+#pragma omp taskwait                                            //  Next round reuses the children
+    }                                                           // End loop over rounds
+  }
+
+  /**
+   * @brief Far field of periodic images, from the multipole of the source root
+   *
+   * @details traversal() handles the 27 images nearest to the root. Each of the
+   * remaining images-1 levels has a periodic block. The 26 neighbors of the
+   * block are split into 27 sub-blocks each, and these are translated by M2L
+   * into the target root. The block is then enlarged three times by M2M of 27
+   * shifted copies of itself. The cost does not depend on the number of bodies.
+   *
+   * @param ctx Context with cycle, images, and the tables for M2L and M2M
+   * @param Ci0 Root cell of target tree
+   * @param Cj0 Root cell of source tree
+   */
+  void traversePeriodic(Context & ctx, Cell * Ci0, Cell * Cj0) {
+    Cells pcells(28);                                           // 27 copies of a periodic block and the block
+    Cell * Cb = &pcells[27];                                    // Periodic block
+    std::vector<coef_t> M(Cj0->M, Cj0->M+ctx.NTERM*ctx.NRHS), M2(ctx.NTERM*ctx.NRHS);// Multipole coefs of block and enlarged block
+    for (int d=0; d<3; d++) Cb->X[d] = Cj0->X[d];               // Block is centered at the source root
+    Cb->R = ctx.cycle / 2;                                      // Radius of block
+    Cb->M = M.data();                                           // Multipole coefs of block
+    real_t period = ctx.cycle;                                  // Size of block
+    for (int level=0; level<ctx.images-1; level++) {            // Loop over sublevels of images
+      for (int ix=-1; ix<=1; ix++) {                            //  Loop over x periodic direction
+        for (int iy=-1; iy<=1; iy++) {                          //   Loop over y periodic direction
+          for (int iz=-1; iz<=1; iz++) {                        //    Loop over z periodic direction
+            if (ix == 0 && iy == 0 && iz == 0) continue;        //     Near images are already done
+            for (int cx=-1; cx<=1; cx++) {                      //     Loop over x sub-block
+              for (int cy=-1; cy<=1; cy++) {                    //      Loop over y sub-block
+                for (int cz=-1; cz<=1; cz++) {                  //       Loop over z sub-block
+                  ctx.Xperiodic[0] = (ix * 3 + cx) * period;    //        Coordinate shift for x periodic direction
+                  ctx.Xperiodic[1] = (iy * 3 + cy) * period;    //        Coordinate shift for y periodic direction
+                  ctx.Xperiodic[2] = (iz * 3 + cz) * period;    //        Coordinate shift for z periodic direction
+                  M2L(ctx, Ci0, Cb);                            //        M2L kernel
+                }                                               //       End loop over z sub-block
+              }                                                 //      End loop over y sub-block
+            }                                                   //     End loop over x sub-block
+          }                                                     //    End loop over z periodic direction
+        }                                                       //   End loop over y periodic direction
+      }                                                         //  End loop over x periodic direction
+      Cell * Cj = &pcells[0];                                   //  First copy of block
+      for (int ix=-1; ix<=1; ix++) {                            //  Loop over x periodic direction
+        for (int iy=-1; iy<=1; iy++) {                          //   Loop over y periodic direction
+          for (int iz=-1; iz<=1; iz++, Cj++) {                  //    Loop over z periodic direction
+            Cj->X[0] = Cb->X[0] + ix * period;                  //     Shifted x of copy
+            Cj->X[1] = Cb->X[1] + iy * period;                  //     Shifted y of copy
+            Cj->X[2] = Cb->X[2] + iz * period;                  //     Shifted z of copy
+            Cj->R = Cb->R;                                      //     Radius of copy
+            Cj->M = M.data();                                   //     Copies share the coefs of block
+          }                                                     //    End loop over z periodic direction
+        }                                                       //   End loop over y periodic direction
+      }                                                         //  End loop over x periodic direction
+      std::fill(M2.begin(), M2.end(), coef_t(0));               //  Initialize enlarged block
+      Cb->M = M2.data();                                        //  M2M accumulates into enlarged block
+      Cb->CHILD = &pcells[0];                                   //  Copies are the children of block
+      Cb->NCHILD = 27;                                          //  Number of copies
+      M2M(ctx, Cb);                                             //  M2M kernel
+      M.swap(M2);                                               //  Enlarged block becomes the block
+      Cb->M = M.data();                                         //  Multipole coefs of block
+      Cb->R *= 3;                                               //  Radius of enlarged block
+      period *= 3;                                              //  Size of enlarged block
+    }                                                           // End loop over sublevels of images
+    for (int d=0; d<3; d++) ctx.Xperiodic[d] = 0;               // Reset periodic coordinate shift
+  }
+
+  /**
+   * @brief Dual tree traversal interface
+   *
+   * @details With images > 0, the sources are periodic with period cycle. The
+   * tree is traversed once for each of the 27 nearest images, with the shift in
+   * Xperiodic, and the farther images are added by traversePeriodic(). With
+   * mutual set, a free space traversal of a tree with itself goes through
+   * selfTraversal() instead.
+   *
+   * @param ctx Context with mutual, images, and nspawn
+   * @param icells Target cells
+   * @param jcells Source cells
+   */
+  void traversal(Context & ctx, Cells & icells, Cells & jcells) {
+    if (ctx.mutual) reserveScratch(ctx);                        // Thread count may have changed since initKernel
+    reserveProfile(ctx.counters);                               // Counters for every thread of the team
+#pragma omp parallel                                            // Open thread team
+#pragma omp single nowait                                       // Root task is started by a single thread
+    {
+      if (ctx.images == 0 && ctx.mutual && &icells == &jcells) {// If free space self interaction
+        selfTraversal(ctx, &icells[0]);                         //  Each pair of cells once
+      } else if (ctx.images == 0) {                             // Else if free space
+        dualTreeTraversal(ctx, &icells[0], &jcells[0]);         //  Recursive call for dual tree traversal
+      } else {                                                  // Else periodic
+        for (int ix=-1; ix<=1; ix++) {                          //  Loop over x periodic direction
+          for (int iy=-1; iy<=1; iy++) {                        //   Loop over y periodic direction
+            for (int iz=-1; iz<=1; iz++) {                      //    Loop over z periodic direction
+              ctx.Xperiodic[0] = ix * ctx.cycle;                //     Coordinate shift for x periodic direction
+              ctx.Xperiodic[1] = iy * ctx.cycle;                //     Coordinate shift for y periodic direction
+              ctx.Xperiodic[2] = iz * ctx.cycle;                //     Coordinate shift for z periodic direction
+              dualTreeTraversal(ctx, &icells[0], &jcells[0]);   //     Returns after all its tasks are done
+            }                                                   //    End loop over z periodic direction
+          }                                                     //   End loop over y periodic direction
+        }                                                       //  End loop over x periodic direction
+        for (int d=0; d<3; d++) ctx.Xperiodic[d] = 0;           //  Reset periodic coordinate shift
+        traversePeriodic(ctx, &icells[0], &jcells[0]);          //  Far images
+      }                                                         // End if for periodic
+    }
+  }
+
+  //! Collect cells that have interaction lists, in body order with parents first
+  void getTargets(Cells & cells, std::vector<Cell *> & targets) {
+    for (size_t i=0; i<cells.size(); i++) {                     // Loop over cells
+      if (!cells[i].listM2L.empty() || !cells[i].listP2P.empty()) {// If cell has interactions
+        targets.push_back(&cells[i]);                           //   Add to targets
+      }                                                         //  End if for interactions
+    }                                                           // End loop over cells
+    std::stable_sort(targets.begin(), targets.end(),            // Sort in body order, parents stay first
+                     [](const Cell * a, const Cell * b) { return a->BODY < b->BODY; });
+  }
+
+  /**
+   * @brief Split a sequence of costs into contiguous chunks of equal total cost
+   *
+   * @details Chunk t is [offsets[t], offsets[t+1]). A chunk boundary is placed
+   * where the running sum of cost first reaches t / nchunk of the total, so a
+   * single target heavier than a chunk ends up alone in its chunk.
+   *
+   * @param cost Cost of each target
+   * @param nchunk Number of chunks
+   * @param offsets Index of first target of each chunk, and the number of targets
+   */
+  void partitionTargets(const std::vector<double> & cost, int nchunk, std::vector<int> & offsets) {
+    std::vector<double> scan(cost.size());                      // Inclusive scan of cost
+    double sum = 0;                                             // Running sum
+    for (size_t i=0; i<cost.size(); i++) scan[i] = sum += cost[i];// Scan cost
+    offsets.resize(nchunk+1);                                   // Allocate offsets
+    for (int t=0; t<nchunk; t++) {                              // Loop over chunks
+      offsets[t] = std::lower_bound(scan.begin(), scan.end(), sum * t / nchunk) - scan.begin();// Start of chunk
+    }                                                           // End loop over chunks
+    offsets[0] = 0;                                             // First chunk starts at first target
+    offsets[nchunk] = cost.size();                              // Last chunk ends at last target
+  }
+
+  /**
+   * @brief Build M2L and P2P interaction lists of the target tree without evaluating kernels
+   *
+   * @details The lists stay valid as long as the tree structure does not change,
+   * so they can be evaluated repeatedly by evaluateLists() after the bodies move.
+   * The lists are for free space; periodic images need traversal().
+   *
+   * @param ctx Context with theta
+   * @param icells Target cells
+   * @param jcells Source cells
+   */
+  void buildLists(Context & ctx, Cells & icells, Cells & jcells) {
+    for (size_t i=0; i<icells.size(); i++) {                    // Loop over target cells
+      icells[i].listM2L.clear();                                //  Clear M2L list
+      icells[i].listP2P.clear();                                //  Clear P2P list
+    }                                                           // End loop over target cells
+#pragma omp parallel                                            // Open thread team
+#pragma omp single nowait                                       // Root task is started by a single thread
+    dualTreeTraversal(ctx, &icells[0], &jcells[0], true);       // Recursive call for dual tree traversal
+    std::vector<Cell *> targets;                                // Cells with interaction lists
+    getTargets(icells, targets);                                // Collect cells with interaction lists
+#pragma omp parallel for schedule(dynamic)
+    for (int i=0; i<int(targets.size()); i++) {                 // Loop over target cells
+      std::sort(targets[i]->listM2L.begin(), targets[i]->listM2L.end());// Sort sources for locality
+      std::sort(targets[i]->listP2P.begin(), targets[i]->listP2P.end());// Sort sources for locality
+    }                                                           // End loop over target cells
+  }
+
+  /**
+   * @brief Evaluate M2L kernels from interaction lists
+   *
+   * @details Each target cell owns its list, so targets are distributed over
+   * threads with no synchronization other than the implicit barrier. Each
+   * thread gets a contiguous chunk of targets in body order, with an equal
+   * share of M2L pairs. With batchM2L, all M2L pairs are first collected and
+   * passed to M2Lbatch.
+   *
+   * @param ctx Context with batchM2L and the tables for M2L
+   * @param targets Cells with interaction lists
+   */
+  void evaluateM2L(Context & ctx, std::vector<Cell *> & targets) {
+    reserveProfile(ctx.counters);                               // Counters for every thread of the team
+    if (ctx.batchM2L) {                                         // If M2L is batched
+      std::vector<CellPair> pairs;                              //  All M2L pairs
+      for (size_t i=0; i<targets.size(); i++) {                 //  Loop over target cells
+        for (size_t j=0; j<targets[i]->listM2L.size(); j++) {   //   Loop over M2L list
+          pairs.push_back(CellPair(targets[i], targets[i]->listM2L[j]));// Add pair
+        }                                                       //   End loop over M2L list
+      }                                                         //  End loop over target cells
+      M2Lbatch(ctx, pairs);                                     //  Batched M2L kernel
+      return;                                                   //  Done
+    }                                                           // End if for batched M2L
+    std::vector<double> cost(targets.size());                   // Cost of each target
+    for (size_t i=0; i<targets.size(); i++) cost[i] = targets[i]->listM2L.size();// Number of M2L pairs
+    std::vector<int> offsets;                                   // Chunk of each thread
+#pragma omp parallel
+    {
+#pragma omp single
+      partitionTargets(cost, omp_get_num_threads(), offsets);   // Balance M2L pairs over threads
+      int t = omp_get_thread_num();                             // Chunk of this thread
+      for (int i=offsets[t]; i<offsets[t+1]; i++) {             // Loop over target cells in chunk
+        Cell * C = targets[i];                                  //  Target cell
+        for (size_t j=0; j<C->listM2L.size(); j++) {            //  Loop over M2L list
+          M2L(ctx, C, C->listM2L[j]);                           //   M2L kernel
+        }                                                       //  End loop over M2L list
+      }                                                         // End loop over target cells in chunk
+    }                                                           // End parallel region
+  }
+
+  /**
+   * @brief Evaluate P2P kernels from interaction lists
+   *
+   * @details The cost of a target is its number of body pairs, the sum of
+   * NBODY of its P2P sources times its own NBODY. Each thread gets a contiguous
+   * chunk of targets in body order with an equal share of that cost, so a few
+   * dense leaves of a clustered distribution do not leave threads idle.
+   *
+   * @param ctx Context with NRHS
+   * @param targets Cells with interaction lists
+   */
+  void evaluateP2P(Context & ctx, std::vector<Cell *> & targets) {
+    std::vector<double> cost(targets.size());                   // Cost of each target
+    for (size_t i=0; i<targets.size(); i++) {                   // Loop over target cells
+      double nj = 0;                                            //  Number of source bodies
+      for (size_t j=0; j<targets[i]->listP2P.size(); j++) nj += targets[i]->listP2P[j]->NBODY;// Sum sources
+      cost[i] = nj * targets[i]->NBODY;                         //  Number of body pairs
+    }                                                           // End loop over target cells
+    std::vector<int> offsets;                                   // Chunk of each thread
+    reserveProfile(ctx.counters);                               // Counters for every thread of the team
+#pragma omp parallel
+    {
+#pragma omp single
+      partitionTargets(cost, omp_get_num_threads(), offsets);   // Balance body pairs over threads
+      int t = omp_get_thread_num();                             // Chunk of this thread
+      for (int i=offsets[t]; i<offsets[t+1]; i++) {             // Loop over target cells in chunk
+        Cell * C = targets[i];                                  //  Target cell
+        for (size_t j=0; j<C->listP2P.size(); j++) {            //  Loop over P2P list
+          P2P(ctx, C, C->listP2P[j]);                           //   P2P kernel
+        }                                                       //  End loop over P2P list
+      }                                                         // End loop over target cells in chunk
+    }                                                           // End parallel region
+  }
+
+  //! Evaluate M2L and P2P kernels from interaction lists
+  void evaluateLists(Context & ctx, Cells & icells) {
+    std::vector<Cell *> targets;                                // Cells with interaction lists
+    getTargets(icells, targets);                                // Collect cells with interaction lists
+    evaluateM2L(ctx, targets);                                  // M2L kernels
+    evaluateP2P(ctx, targets);                                  // P2P kernels
+  }
+
+  /**
+   * @brief Downward pass, level by level
+   *
+   * @details L2L runs for one level at a time from the top down, as a parallel
+   * loop over the cells of the level. Each cell only writes the L of its own
+   * children, and the barrier at the end of each loop makes a level complete
+   * before it is translated further. All leafs then run L2P in one parallel loop.
+   *
+   * @param ctx Context with the tables for L2L and L2P
+   * @param tree Tree from buildTree()
+   */
+  void downwardPass(Context & ctx, Tree & tree) {
+    Cells & cells = tree.cells;                                 // Cells in level order
+    const std::vector<int> & levels = tree.levels;              // Index of first cell of each level
+    int ncells = cells.size();                                  // Number of cells
+    reserveProfile(ctx.counters);                               // Counters for every thread of the team
+#pragma omp parallel                                            // Open thread team
+    {
+      for (int level=0; level<int(levels.size())-1; level++) {  //  Loop over levels top down
+#pragma omp for schedule(dynamic)
+        for (int c=levels[level]; c<levels[level+1]; c++) {     //   Loop over cells at this level
+          if (cells[c].NCHILD != 0) L2L(ctx, &cells[c]);        //    L2L kernel
+        }                                                       //   End loop over cells at this level
+      }                                                         //  End loop over levels
+#pragma omp for schedule(dynamic)
+      for (int c=0; c<ncells; c++) {                            //  Loop over cells
+        if (cells[c].NCHILD == 0) L2P(ctx, &cells[c]);          //   L2P kernel
+      }                                                         //  End loop over cells
+    }                                                           // End parallel region
+  }
+
+  //! Direct summation, always in real_t so that it is a reference for mixed precision
+  void direct(Context & ctx, Bodies & bodies, Bodies & jbodies) {
+    int npad = paddedSize(jbodies.size());                      // Length of each of the x, y, z, q arrays
+    std::vector<real_t, AlignedAllocator<real_t> > SRC(4 * npad, 0);// SoA copy of source bodies
+    for (size_t b=0; b<jbodies.size(); b++) {                   // Loop over source bodies
+      for (int d=0; d<3; d++) SRC[d*npad+b] = jbodies[b].X[d];  //  Copy coordinates
+      SRC[3*npad+b] = jbodies[b].q;                             //  Copy charge
+    }                                                           // End loop over source bodies
+    int prange = 0;                                             // Range of periodic images
+    for (int i=0; i<ctx.images; i++) prange += int(std::pow(3.,i));// Same images as traversal()
+    for (size_t b=0; b<bodies.size(); b++) {                    // Loop over target bodies
+      for (int ix=-prange; ix<=prange; ix++) {                  //  Loop over x periodic direction
+        for (int iy=-prange; iy<=prange; iy++) {                //   Loop over y periodic direction
+          for (int iz=-prange; iz<=prange; iz++) {              //    Loop over z periodic direction
+            real_t X[3] = {bodies[b].X[0] - ix * ctx.cycle,     //     Target shifted by periodic image
+                           bodies[b].X[1] - iy * ctx.cycle,
+                           bodies[b].X[2] - iz * ctx.cycle};
+            P2P(X, &SRC[0], &SRC[npad], &SRC[2*npad], &SRC[3*npad], npad, bodies[b].p, bodies[b].F);// Evaluate P2P kernel
+          }                                                     //    End loop over z periodic direction
+        }                                                       //   End loop over y periodic direction
+      }                                                         //  End loop over x periodic direction
+    }                                                           // End loop over target bodies
+  }
+
+  /**
+   * @brief Dipole correction from the cube of images to tin foil boundary conditions
+   *
+   * @details The sum over a growing cube of images depends on the dipole of the
+   * box D. Removing \f$ \frac{4\pi}{3V} D \f$ from the force and its potential
+   * gives the result with a conducting boundary, as in Ewald summation.
+   *
+   * @param ctx Context with cycle and NRHS
+   * @param bodies Target bodies
+   * @param jbodies Source bodies in the periodic box
+   */
+  void dipoleCorrection(Context & ctx, Bodies & bodies, Bodies & jbodies) {
+    real_t coef = 4 * M_PI / (3 * ctx.cycle * ctx.cycle * ctx.cycle);// Shape factor of a cube
+    for (int r=0; r<ctx.NRHS; r++) {                            // Loop over right-hand sides
+      real_t dipole[3] = {0, 0, 0};                             //  Dipole of the periodic box
+      for (size_t b=0; b<jbodies.size(); b++) {                 //  Loop over source bodies
+        for (int d=0; d<3; d++) dipole[d] += jbodies[b].X[d] * charge(ctx, jbodies[b], r);// Accumulate dipole
+      }                                                         //  End loop over source bodies
+      for (size_t b=0; b<bodies.size(); b++) {                  //  Loop over target bodies
+        for (int d=0; d<3; d++) {                               //   Loop over dimensions
+          potential(ctx, bodies[b], r) -= coef * dipole[d] * bodies[b].X[d];// Potential correction
+          force(ctx, bodies[b], r)[d] -= coef * dipole[d];      //    Force correction
+        }                                                       //   End loop over dimensions
+      }                                                         //  End loop over target bodies
+    }                                                           // End loop over right-hand sides
   }
 }
 #endif
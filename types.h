@@ -3,6 +3,7 @@
 #include <complex>
 #include <cstdlib>
 #include <cstdio>
+#include <new>
 #include <vector>
 
 //! Namespace of exafmm
@@ -10,9 +11,41 @@ namespace exafmm {
   // Basic type definitions
   typedef double real_t;                                        //!< Floating point type
   typedef std::complex<real_t> complex_t;                       //!< Complex type
+#if EXAFMM_FLOAT_P2P
+  typedef float p2p_t;                                          //!< Floating point type of P2P sources and arithmetic
+#else
+  typedef real_t p2p_t;                                         //!< Floating point type of P2P sources and arithmetic
+#endif
+#if EXAFMM_FLOAT_COEFS
+  typedef std::complex<float> coef_t;                           //!< Complex type of stored expansion coefs
+#else
+  typedef complex_t coef_t;                                     //!< Complex type of stored expansion coefs
+#endif
+  const int SIMD_BYTES = 64;                                    //!< Alignment of SIMD arrays (AVX-512 width)
+  const int NSIMD = SIMD_BYTES / sizeof(float);                 //!< Padding of SoA arrays, aligned for float and double
+
+  //! Allocator for SIMD_BYTES aligned arrays
+  template<typename T>
+  struct AlignedAllocator {
+    typedef T value_type;                                       //!< Type of allocated elements
+    AlignedAllocator() {}
+    template<typename U> AlignedAllocator(const AlignedAllocator<U> &) {}
+    T * allocate(size_t n) {
+      void * ptr;
+      if (posix_memalign(&ptr, SIMD_BYTES, n * sizeof(T))) throw std::bad_alloc();
+      return static_cast<T *>(ptr);
+    }
+    void deallocate(T * ptr, size_t) { free(ptr); }
+  };
+  template<typename T, typename U>
+  bool operator==(const AlignedAllocator<T> &, const AlignedAllocator<U> &) { return true; }
+  template<typename T, typename U>
+  bool operator!=(const AlignedAllocator<T> &, const AlignedAllocator<U> &) { return false; }
+  typedef std::vector<p2p_t, AlignedAllocator<p2p_t> > AlignedVector;//!< Aligned vector of p2p_t
 
   //! Structure of bodies
   struct Body {
+    int IBODY;                                                  //!< Index of body before sorting, for extra right-hand sides
     real_t X[3];                                                //!< Position
     real_t q;                                                   //!< Charge
     real_t p;                                                   //!< Potential
@@ -24,13 +57,29 @@ namespace exafmm {
   struct Cell {
     int NCHILD;                                                 //!< Number of child cells
     int NBODY;                                                  //!< Number of descendant bodies
+    int LEVEL;                                                  //!< Level of cell, 0 for the root
     Cell * CHILD;                                               //!< Pointer of first child cell
     Body * BODY;                                                //!< Pointer of first body
     real_t X[3];                                                //!< Cell center
     real_t R;                                                   //!< Cell radius
-    std::vector<complex_t> M;                                   //!< Multipole expansion coefs
-    std::vector<complex_t> L;                                   //!< Local expansion coefs
+    coef_t * M;                                                 //!< Multipole expansion coefs, NTERM per right-hand side
+    coef_t * L;                                                 //!< Local expansion coefs, NTERM per right-hand side
+    AlignedVector SRC;                                          //!< SoA x, y, z, q of leaf bodies, each padded to NSIMD
+    std::vector<Cell *> listM2L;                                //!< Source cells of M2L interactions
+    std::vector<Cell *> listP2P;                                //!< Source cells of P2P interactions
   };
   typedef std::vector<Cell> Cells;                              //!< Vector of cells
+
+  //! Tree of cells in level order, owning the expansion coefs of its cells
+  struct Tree {
+    Cells cells;                                                //!< Cells in level order, children of a cell contiguous
+    std::vector<int> levels;                                    //!< Index of first cell of each level, and number of cells
+    std::vector<coef_t> coefs;                                  //!< Arena of M and L of all cells
+    std::vector<int> leafs;                                     //!< Index of leaf cells in body order
+    Bodies buffer;                                              //!< Reused buffer for reordering bodies
+    std::vector<int> leafIndex;                                 //!< Index in leafs of each cell, -1 if not a leaf
+    std::vector<int> moveCounts;                                //!< Reused counts and offsets of movers per leaf
+    std::vector<int> movers;                                    //!< Reused body index and new leaf of movers
+  };
 }
 #endif